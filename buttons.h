@@ -0,0 +1,48 @@
+// ECE 4760 Final Project: push button input
+//
+// Shared by fft.c and video.c. The buttons are on port C and read 1 while
+// pressed. buttons_scan() runs from a timer driven ISR every 16 ms or so
+// and reads PINC once for all of them: a bit that reads the same on two
+// scans in a row is the button's new state, and a press followed by a
+// release queues an event. Main only has to test btnevents, buttons_run()
+// then calls the handler of every button in its table that was released,
+// the same toggle on release the old debounce state machines made.
+// Each firmware is one translation unit, so the state and functions below
+// are static: include this from fft.c or video.c only, not from a second
+// file of the same firmware, which would get its own copy.
+
+#ifndef BUTTONS_H
+#define BUTTONS_H
+
+typedef struct {
+	unsigned char mask;		// PINC bit
+	void (*release)(void);	// option handler
+} button_t;
+
+static volatile unsigned char btnevents;	// buttons released since buttons_run()
+static unsigned char btnlast;				// PINC at the last scan
+static unsigned char btnstate;				// debounced buttons
+
+//debounce the buttons in mask, called from an ISR
+static inline void buttons_scan(unsigned char mask) {
+	unsigned char now = PINC & mask;
+	unsigned char stable = ~(now ^ btnlast);
+
+	btnlast = now;
+	btnevents |= btnstate & ~now & stable;
+	btnstate = (btnstate & ~stable) | (now & stable);
+}
+
+//run the handlers of the buttons released since the last call
+static void buttons_run(const button_t *table, unsigned char n) {
+	unsigned char ev;
+
+	cli();
+	ev = btnevents;
+	btnevents = 0;
+	sei();
+	for (unsigned char i = 0; i < n; i++)
+		if (ev & table[i].mask) table[i].release();
+}
+
+#endif
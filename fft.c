@@ -15,6 +15,7 @@
 #define F_CPU 16000000UL
 #include <util/delay.h>  
 #include <avr/sleep.h>
+#include "buttons.h"
 
 // optional, if preferred//
 #define begin {
@@ -57,37 +58,264 @@ prod;                        \
 
 //FFT buffer
 #define spectrum_bins 32 			// amount of bins to send/display
-int fftarray[N_WAVE];				// array to hold FFT points
 char specbuff[spectrum_bins];		// array to hold freq bin data to transmit
 char erasespecbuff[spectrum_bins];	// empty array to clear spec buff
 unsigned char currbin;				// index of specbuff
 
+//Link frames start with a header packet: LINK_SYNC, the gain shift the
+//input was scaled up by, flags and a frame count. The bins follow in 8 packets.
+#define LINK_HEADER 4
+#define LINK_SYNC 0xA5
+#define LINK_GAIN_REF 4		// the <<4 pre-scale of 8 bit samples, unity gain
+#define LINK_AGC 0x01		// flag: bins were scaled by the gain shift
+#define LINK_DC 0x02		// flag: DC is filtered out, bin 0 is real signal
+#define LINK_IDLE 0x04		// flag: paused, only the header packet is sent
+#define LINK_TRIG 0x08		// flag: frame of a trigger burst, numbered from 0
+#define LINK_LAST 0x10		// flag: last frame of the burst
+unsigned char linkhdr[LINK_HEADER];
+unsigned char linkflags;	// more flags for the frames being sent
+
+//Commands from the Video MCU arrive on RXD0, shifted in by the link clock
+//while we transmit, one byte each: the opcode in the high nibble and the
+//argument in the low one. They are queued by the receive ISR and applied
+//by main between frames.
+#define CMD_SPAN 0x10		// freqopt: 0 4 kHz, 1 2 kHz
+#define CMD_WINDOW 0x20		// window, WINDOW_*
+#define CMD_AVERAGE 0x30	// send the mean of 2^n frames
+#define CMD_BINS 0x40		// compute only the lowest 4n bins, 0 all
+#define CMD_PAUSE 0x50		// 1 stop computing and sending, 0 run
+#define CMD_TRIGGER 0x60	// arm the trigger: 0 off, TRIG_SRC_*
+#define CMD_TRIGLEVEL 0x70	// trigger at (n+1)*8 counts, or a band sum of (n+1)*16
+#define CMD_TRIGBAND 0x80	// trigger band is bins 2n and 2n+1
+#define CMD_SIZE 8
+#define CMD_MASK (CMD_SIZE-1)
+unsigned char cmdring[CMD_SIZE];
+volatile unsigned char cmdhead;	// next byte written by the receive ISR
+unsigned char cmdtail;			// next byte applied by main
+
+//Window options, adcMask is rebuilt when CMD_WINDOW changes it
+#define WINDOW_TRAPEZOID 0	// 1/4 length slopes
+#define WINDOW_RECT 1
+#define WINDOW_HANN 2
+#define WINDOWS 3
+unsigned char winopt;
+
+//Averaging: the bins of 2^avgshift frames are summed and their mean sent.
+//With AGC every frame still gets its own shift, the sum is kept at the
+//smallest shift of the group so far and the other frames are scaled down
+//to it, each shift being 4x in magnitude. The mean goes out with that shift.
+#define AVG_MAX 3
+unsigned char avgshift, avgcount;
+unsigned int avgsum[spectrum_bins];
+unsigned char avggain;		// gain shift of avgsum
+
+unsigned char specbins;		// bins computed, CMD_BINS
+char pauseopt;				// CMD_PAUSE
+
+//With PAUSE_SLEEP the paused MCU powers down, timer and ADC included,
+//until the Video MCU raises Rx Ready. It only does that while paused to
+//send a command, a pin change on PD7 wakes us to clock it in. The buttons
+//are not scanned while powered down. Without PAUSE_SLEEP the paused MCU
+//keeps sampling and answers every Rx Ready.
+#define PAUSE_SLEEP 1
+
+//Automatic gain control. Each block is shifted up as far as its peak
+//sample allows (AGC_PEAK after the shift, FFTfix never grows the data)
+//instead of by the fixed LINK_GAIN_REF. Magnitudes then saturate at 255
+//rather than wrap, and the video MCU divides the gain back out.
+#define AGC 1
+#define AGC_PEAK 4096
+#define AGC_MAX_SHIFT (11-ADC_EXTRA)
+unsigned char gainshift;	// shift applied to the current block
+
+//Spectrum modes. SPECTRUM_FFT sends all 32 bins of the 128 point FFT.
+//SPECTRUM_GOERTZEL runs a Goertzel filter over the windowed block for only
+//the FFT points listed in toneBins, so a frame costs one filter per
+//tone instead of a whole FFT. Each tone is scaled like the FFT point and
+//added into the specbuff bin that point would have gone to, the other
+//bins are sent empty.
+//SPECTRUM_SDFT tracks the same points with a sliding DFT updated in the
+//ADC ISR on every sample, and sends them as fast as the link takes them.
+#define SPECTRUM_FFT 0
+#define SPECTRUM_GOERTZEL 1
+#define SPECTRUM_SDFT 2
+#define SPECTRUM_MODE SPECTRUM_FFT
+
 // ADC Variables
+//ADC_BITS 10 reads the whole right adjusted result, two bits (12 dB) more
+//than ADCH of a left adjusted one. The samples are pre-scaled ADC_EXTRA less
+//so the window, FFT and bins keep the 8 bit scale, and the link header still
+//carries the gain in 8 bit units. ADC_PRESCALE selects the ADC clock:
+//7 (125 kHz, 104 us a conversion) for full 10 bit accuracy when every
+//sample is one conversion.
+//ADC_TRIGGER picks what starts a conversion. ADC_TRIGGER_ISR sets ADSC in
+//the sample ISR as before, ADC_TRIGGER_TIMER has the Timer1 compare B match
+//(the sleep ISR, which also clears the flag for the next trigger) start it
+//in hardware, so the sample point no longer moves with ISR latency and the
+//sample ISR reads the conversion started one sample earlier.
+//ADC_TRIGGER_FREE converts continuously and the ISR takes the latest
+//result, only worth it with a fast ADC_PRESCALE since the sample point is
+//then anywhere in the last conversion.
+//ADC_COMPLETE_ISR takes ADC_TRIGGER_TIMER further: the timer has no
+//interrupts, the ADC conversion complete ISR stores each sample and clears
+//the compare flag for the next trigger. The sample timing no longer depends
+//on the CPU being asleep, so the main loop is never put to sleep and keeps
+//the time the sleep ISR used to take from the FFT.
+//OVERSAMPLE 4 converts four times per sample and the ISR sums them, every
+//4th call passes the sum, shifted down by OS_BITS, on as one sample with
+//one more bit. The sum is also a box car filter over the sample period, so
+//less aliases in. The ADC clock has to keep up: /32 (500 kHz, 26 us a
+//conversion), above the 200 kHz the datasheet gives full 10 bit accuracy
+//for, so the extra bit is mostly noise averaged out. 16 times would need
+//a 2 MHz ADC clock, far outside its accurate range, and leaves 125 cycles
+//between conversions for the whole sample ISR, so it is not offered. The
+//SDFT ISR does not fit between conversions at all.
+#define ADC_TRIGGER_ISR 0
+#define ADC_TRIGGER_FREE 1
+#define ADC_TRIGGER_TIMER 2
+#define ADC_BITS 10
+#define OVERSAMPLE 1
+#define ADC_TRIGGER ADC_TRIGGER_TIMER
+#define ADC_COMPLETE_ISR 1
+#if ADC_COMPLETE_ISR && ADC_TRIGGER != ADC_TRIGGER_TIMER
+#error "ADC_COMPLETE_ISR needs ADC_TRIGGER_TIMER"
+#endif
+#if OVERSAMPLE == 4
+#define OS_BITS 1
+#define ADC_PRESCALE 5
+#elif OVERSAMPLE == 1
+#define OS_BITS 0
+#define ADC_PRESCALE 7
+#else
+#error "OVERSAMPLE is 1 or 4"
+#endif
+#define SAMPLE_TIME (ADC_TIME/OVERSAMPLE)	// cycles per conversion
+#if ADC_BITS > 8
+#define ADC_RESULT ADC
+#else
+#define ADC_RESULT ADCH
+#endif
+#define ADC_EXTRA (ADC_BITS-8+OS_BITS)
+#define ADC_SCALE (LINK_GAIN_REF-ADC_EXTRA)	// pre-scale for unity gain
+#if OVERSAMPLE > 1
+unsigned int osacc;			// sum of this sample's conversions
+unsigned char oscount;		// conversions left to sum
+#endif
+//The input bias is about 1.4V (140 counts) but differs between boards and
+//drifts with temperature. With DC_BLOCK the running mean of the samples,
+//a one pole low pass of about 5 Hz (2^DC_SHIFT samples), is subtracted
+//instead of the constant, so bin 0 only holds real low frequencies.
+#define DC_BLOCK 1
+#define DC_SHIFT 8
+#define DC_OFFSET (140<<ADC_EXTRA)
+#if ADC_EXTRA > 0
+unsigned long dcacc;	// running mean << DC_SHIFT
+#else
+unsigned int dcacc;		// running mean << DC_SHIFT
+#endif
+#if SPECTRUM_MODE == SPECTRUM_SDFT
+// ring of the last N_WAVE samples, stored twice so any N_WAVE of them are
+// contiguous: the window starting at adcind runs oldest to newest
+volatile signed int adcbuff[2*N_WAVE];
+#else
 volatile signed int adcbuff[N_WAVE];	// array to hold ADC audio sample points
+#endif
 volatile char adcind;					// index of adcbuff
 int adcMask[N_WAVE];					// trapezoidal windowing function for ADC buffer
 
-// State Machine Variables
-#define Release 0
-#define Debounce 1
-#define Pressed 2
-#define DebounceRel 3
-#define Toggle 4
-
-// Button FSM
-unsigned char freqState; // State variable for freqScaleFSM
-unsigned char buttons;	 // stores value of PINC
+// Buttons, scanned every BUTTON_TICKS samples (16 ms)
+#define BUTTON_TICKS 128
+unsigned char buttontick;
 
 // User options
 char freqopt;			// frequency scale option
 
 //function declarations
-void freqScaleFSM(void);	// state machine function for freq scale select option button
+void freqToggle(void);		// freq scale select option button
+void sendSpectrum(void);	// send specbuff to the Video MCU
+void sendIdle(void);		// send an idle header while paused
+void pauseSleep(void);		// power down while paused
+void resume(void);			// start over with fresh samples
+void cmdApply(void);		// apply queued commands
+void computeSpectrum(void);	// spectrum of fr[] into specbuff
+
+const button_t fftButtons[] = {
+	{1<<0, freqToggle},
+};
+#define BUTTONS (sizeof(fftButtons)/sizeof(fftButtons[0]))
 
 int Sinewave[N_WAVE]; // a table of sines for the FFT	
 
 signed int fr[N_WAVE],fi[N_WAVE],erasefi[N_WAVE];	// arrays used by FFT to store real, imaginary data, and a blank erase array
 
+#if SPECTRUM_MODE == SPECTRUM_SDFT && OVERSAMPLE > 1
+#error "the SDFT ISR does not fit between oversampled conversions"
+#endif
+#if SPECTRUM_MODE != SPECTRUM_FFT
+#define TONES 6
+// FFT points to watch, point k is k*62.5 Hz. The 8.8 cosines detune the
+// Goertzel filters near 0 and 64, so keep to points 2-60, and to 5-59 for
+// SPECTRUM_GOERTZEL, whose 16 bit state overflows closer to them.
+const unsigned char toneBins[TONES] = {7, 11, 14, 16, 22, 28};
+#endif
+#if SPECTRUM_MODE == SPECTRUM_GOERTZEL
+int gcos[TONES], gsin[TONES];	// twiddles from Sinewave
+#endif
+#if SPECTRUM_MODE == SPECTRUM_SDFT
+//Each sample x(n) updates S = r*W*(S + x(n) - r^N*x(n-N)), W = e^(j*2pi*k/N),
+//so S holds the DFT of the last N samples weighted by r^(age+1). The damping
+//r keeps rounding errors from building up, and every SDFT_RESYNC frames a
+//full FFTfix of the same weighted window replaces whatever error is left.
+//S is the raw DFT of the 8 bit scaled ADC values, 8 times FFTfix's scale.
+#define SDFT_R 0.999			// damping per sample, r^N is about 0.88
+#define SDFT_RESYNC 16			// frames between resyncs
+volatile int sre[TONES], sim[TONES];	// bin states
+int scos[TONES], ssin[TONES];			// r*W in 1.14
+int srn;								// r^N in 1.14
+int sdftDamp[N_WAVE+1];					// r^i in 8.8
+unsigned char sdftframe;				// frames since the last resync
+#endif
+
+//Trigger capture. Every sample also goes into trigring, TRIG_BLOCKS blocks
+//long. Once armed, and TRIG_PRE blocks of history are in, the trigger is
+//either a sample beyond triglevel, checked in the ISR, or the sum of the
+//two specbuff bins from trigband beyond trigthresh, checked on each frame.
+//The ring then fills with the blocks after the trigger and freezes, and
+//main sends it as a burst of TRIG_BLOCKS frames flagged LINK_TRIG, oldest
+//first, and disarms until the next CMD_TRIGGER. The frames in between go
+//on as usual. The sliding DFT keeps no blocks to send, so no trigger there.
+//The ring takes 2K of SRAM and time in every sample ISR, so TRIGGER is off
+//by default, set it to 1 for a video.c built with a TRIG_MODE.
+#define TRIGGER 0
+#if SPECTRUM_MODE == SPECTRUM_SDFT
+#undef TRIGGER
+#define TRIGGER 0
+#endif
+#if TRIGGER
+#define TRIG_BLOCKS 8			// 128 ms burst, at most BURST_MAX in video.c
+#define TRIG_PRE 2				// blocks before the trigger
+#define TRIG_SIZE (TRIG_BLOCKS*N_WAVE)
+#define TRIG_MASK (TRIG_SIZE-1)
+#define TRIG_OFF 0				// trigger states
+#define TRIG_FILL 1				// armed, waiting for the history
+#define TRIG_ARMED 2
+#define TRIG_POST 3				// triggered, capturing the blocks after it
+#define TRIG_HELD 4				// frozen until the burst is sent
+#define TRIG_SRC_LEVEL 1		// CMD_TRIGGER sources
+#define TRIG_SRC_BAND 2
+volatile int trigring[TRIG_SIZE];
+volatile unsigned int trigind;		// next sample written, the oldest once held
+volatile unsigned int trigcount;	// samples left to fill or capture
+volatile unsigned char trigstate;
+unsigned char trigsource;
+int triglevel;						// |sample| that triggers
+unsigned int trigthresh;			// band sum that triggers
+unsigned char trigband;				// first bin of the band
+void trigArm(unsigned char src);	// arm or disarm the trigger
+void sendBurst(void);				// send the frozen ring
+#endif
+
+#if !ADC_COMPLETE_ISR
 // put the MCU to sleep JUST before the CompA ISR goes off to ensure precise timing
 ISR(TIMER1_COMPB_vect, ISR_NAKED)
 {
@@ -95,18 +323,125 @@ ISR(TIMER1_COMPB_vect, ISR_NAKED)
 	sleep_cpu();
 	reti();
 }
+#endif
 
 //==================================
 //This is ADC sampling of the audio signal. It MUST be entered from 
-//sleep mode to get accurate timing of samples.
+//sleep mode to get accurate timing of samples, unless the conversion
+//is started by the timer and this runs when it completes.
+
+//read the finished conversion, or the decimated sum, without its DC offset
+static inline int adc_sample(void) {
+#if OVERSAMPLE > 1
+	unsigned int x = osacc >> OS_BITS;
+	osacc = 0;
+#elif ADC_BITS > 8
+	unsigned int x = ADC;
+#else
+	unsigned char x = ADCH;
+#endif
+#if DC_BLOCK
+	dcacc += x - (dcacc >> DC_SHIFT);
+	return x - (int)((dcacc + (1<<(DC_SHIFT-1))) >> DC_SHIFT);
+#else
+	return x - DC_OFFSET;	// corresponds to about 1.4V
+#endif
+}
+
+#if TRIGGER
+//start capturing the blocks after the trigger
+static inline void trigFire(void) {
+	trigstate = TRIG_POST;
+	trigcount = (TRIG_BLOCKS-TRIG_PRE)*N_WAVE;
+}
+
+//one sample into the trigger ring, constant time
+static inline void trigSample(int x) {
+	if (trigstate == TRIG_HELD) return;
+	trigring[trigind] = x;
+	trigind = (trigind + 1) & TRIG_MASK;
+	if (trigstate == TRIG_ARMED) {
+		if (trigsource == TRIG_SRC_LEVEL && (x > triglevel || x < -triglevel)) trigFire();
+	}
+	else if (trigstate != TRIG_OFF && --trigcount == 0)
+		trigstate = (trigstate == TRIG_FILL) ? TRIG_ARMED : TRIG_HELD;
+}
+#endif
 
 //run this every 125 us for every ADC sample (8 kHz sampling rate, 4 kHz max freq range without aliasing)
+#if ADC_COMPLETE_ISR
+ISR (ADC_vect) {
+	TIFR1 = _BV(OCF1B);		// rearm the trigger
+#else
 ISR (TIMER1_COMPA_vect) {
+#endif
+#if OVERSAMPLE > 1
+	//sum the conversions, only the last of each sample goes on
+	osacc += ADC_RESULT;
+	if (--oscount) {
+#if ADC_TRIGGER == ADC_TRIGGER_ISR
+		ADCSRA |= (1<<ADSC);
+#endif
+		return;
+	}
+	oscount = OVERSAMPLE;
+#endif
+#if SPECTRUM_MODE == SPECTRUM_SDFT
+	int x, a, b;
+	//sample continuously into the ring, the slot taken holds x(n-N)
+	//the 16 bit states only have room for 8 bit samples
+	x = adc_sample() >> ADC_EXTRA;
+#if ADC_TRIGGER == ADC_TRIGGER_ISR
+	ADCSRA |= (1<<ADSC);
+#endif
+	a = x - (int)(((long)srn*adcbuff[adcind] + 8192) >> 14);
+	adcbuff[adcind] = x;
+	adcbuff[adcind+N_WAVE] = x;
+	adcind = (adcind+1) & (N_WAVE-1);
+	//rotate every tracked bin, rounded so the errors average out
+	for (char t=0; t<TONES; t++) {
+		b = sim[t];
+		x = sre[t] + a;
+		sre[t] = ((long)scos[t]*x - (long)ssin[t]*b + 8192) >> 14;
+		sim[t] = ((long)ssin[t]*x + (long)scos[t]*b + 8192) >> 14;
+	}
+#elif TRIGGER
+	//every sample goes to the trigger ring, the block takes them while it fills
+	int x = adc_sample();	// remove the DC offset
+	if (adcind<N_WAVE) adcbuff[adcind++]=x;
+#if ADC_TRIGGER == ADC_TRIGGER_ISR
+	ADCSRA |= (1<<ADSC);
+#endif
+	trigSample(x);
+#else
 	if(adcind<N_WAVE) {	// if ADC buffer isn't full...
 		//store an ADC sample and start the next one
-		adcbuff[adcind++]=ADCH-140;		// subtract 140 to remove DC offset, corresponds to about 1.4V
+		adcbuff[adcind++]=adc_sample();	// remove the DC offset
+#if ADC_TRIGGER == ADC_TRIGGER_ISR
 		ADCSRA |= (1<<ADSC);
+#endif
 	}
+#endif
+	if (--buttontick == 0) {
+		buttontick = BUTTON_TICKS;
+		buttons_scan(1<<0);
+	}
+}
+
+#if PAUSE_SLEEP
+// Rx Ready raised while paused, only here to wake the MCU
+EMPTY_INTERRUPT(PCINT3_vect);
+#endif
+
+//==================================
+//Command byte from the Video MCU
+ISR (USART0_RX_vect) {
+	unsigned char c = UDR0;
+
+	if (((cmdhead + 1) & CMD_MASK) != cmdtail) {
+		cmdring[cmdhead] = c;
+		cmdhead = (cmdhead + 1) & CMD_MASK;
+	}
 }
 
 //------------Start of borrowed code from Bruce Land--------------//
@@ -174,53 +509,435 @@ end
 //------------End of borrowed code from Bruce Land--------------//
 
 //===================================
-//Frequency Scale Select Button Press Debounce FSM
+//Add the magnitude of FFT point k into its bin for the current range.
+//With AGC it saturates, otherwise the low byte is added as it always was.
+#define POINT_BIN(k) ((freqopt==0) ? (k)>>1 : (k))	// specbuff bin of FFT point k
+void specAdd(unsigned char k, int re, int im) {
+	unsigned int m, m2;
+
+#if AGC
+	// a full scale sine or the DC blocker settling can reach AGC_PEAK, and
+	// the square of 4096 no longer fits in 16 bits, so saturate first
+	if (re > AGC_PEAK-1) re = AGC_PEAK-1; else if (re < 1-AGC_PEAK) re = 1-AGC_PEAK;
+	if (im > AGC_PEAK-1) im = AGC_PEAK-1; else if (im < 1-AGC_PEAK) im = 1-AGC_PEAK;
+#endif
+	m = multfix(re,re);
+	m2 = multfix(im,im);
+	m += m2;
+#if AGC
+	if (m < m2) m = 0xffff;
+	if (m > 255) m = 255;
+	if (freqopt==0) k >>= 1;
+	else if (k>=spectrum_bins) return;
+	m += (unsigned char)specbuff[k];
+	specbuff[k] = (m > 255) ? 255 : m;
+#else
+	if (freqopt==0) specbuff[k/2]+=(char)m;
+	else if (k<spectrum_bins) specbuff[k]+=(char)m;
+#endif
+}
+
+#if AGC
+//===================================
+//Largest shift that keeps the block's peak sample within AGC_PEAK
+unsigned char agcShift(void) {
+	int peak = 0, x;
+	unsigned char s = AGC_MAX_SHIFT;
+
+	for (int i=0; i<N_WAVE; i++) {
+		x = (fr[i] < 0) ? -fr[i] : fr[i];
+		if (x > peak) peak = x;
+	}
+	while (s > 0 && peak > (AGC_PEAK >> s)) s--;
+	return s;
+}
+#endif
+
+#if SPECTRUM_MODE == SPECTRUM_GOERTZEL
+//===================================
+//Goertzel filters over the windowed samples in fr[], one pass per tone.
+//FFTfix halves the data every stage, so the samples are scaled down by
+//N_WAVE on the way in and the magnitude is taken the same way. That keeps
+//the state in 16 bits: fr[] is within AGC_PEAK, so it stays under
+//N_WAVE*32/sin(w), about 17000 at points 5 and 59, and each step is one
+//16x16 to 32 bit multiply.
+void goertzel(void) {
+	int s0, s1, s2;
+	int re, im;
+
+	for (char t=0; t<TONES; t++) {
+		if (POINT_BIN(toneBins[t]) >= specbins) continue;
+		s1 = 0;
+		s2 = 0;
+		for (int i=0; i<N_WAVE; i++) {
+			s0 = ((fr[i] + (N_WAVE/2)) >> LOG2_N_WAVE) + (int)(((long)gcos[t] * s1) >> 7) - s2;	// 2cos(w) in 8.8
+			s2 = s1;
+			s1 = s0;
+		}
+		re = s1 - (int)(((long)gcos[t] * s2) >> 8);
+		im = (int)(((long)gsin[t] * s2) >> 8);
+		specAdd(toneBins[t], re, im);
+	}
+}
+#endif
+
+#if SPECTRUM_MODE == SPECTRUM_SDFT
+//===================================
+//Magnitudes of the tracked bins into specbuff, scaled like FFTfix output
+void sdft_spectrum(void) {
+	int re, im;
+
+	memcpy(specbuff,erasespecbuff,spectrum_bins);
+	for (char t=0; t<TONES; t++) {
+		if (POINT_BIN(toneBins[t]) >= specbins) continue;
+		cli();
+		re = sre[t];
+		im = sim[t];
+		sei();
+		re >>= 3;
+		im >>= 3;
+		specAdd(toneBins[t], re, im);
+	}
+}
+
+//===================================
+//Replace the error in the tracked bins with a full FFT of the same window.
+//The ISR keeps sliding while FFTfix runs, but the error only decays and
+//turns with r*W each sample, so the correction found for the window is
+//turned on by the samples since and added in one step.
+void sdft_resync(void) {
+	int er[TONES], ei[TONES], cr[2][TONES], ci[2][TONES];
+	unsigned char p, d, k, a;
+	int c, s, x;
+
+	// bin states and the window they belong to, copied oldest first so
+	// the copy stays ahead of the ISR overwriting it
+	cli();
+	p = adcind;
+	for (char t=0; t<TONES; t++) {er[t] = sre[t]; ei[t] = sim[t];}
+	sei();
+	for (int i=0; i<N_WAVE; i++)
+		fr[i] = multfix((adcbuff[p+i]<<4),sdftDamp[N_WAVE-i]);
+	memcpy(fi,erasefi,sizeof(fi));
+	FFTfix(fr, fi, LOG2_N_WAVE);
+	for (char t=0; t<TONES; t++) {
+		k = toneBins[t];
+		er[t] = (fr[k]<<3) - er[t];
+		ei[t] = (fi[k]<<3) - ei[t];
+	}
+	// the correction for now and for one more sample, in case one lands
+	d = (adcind - p) & (N_WAVE-1);
+	for (char j=0; j<2; j++) {
+		for (char t=0; t<TONES; t++) {
+			a = (toneBins[t]*(d+j)) & (N_WAVE-1);
+			c = Sinewave[(a+N_WAVE/4) & (N_WAVE-1)];
+			s = Sinewave[a];
+			x = multfix(c,er[t]) - multfix(s,ei[t]);
+			ci[j][t] = multfix(sdftDamp[d+j], multfix(s,er[t]) + multfix(c,ei[t]));
+			cr[j][t] = multfix(sdftDamp[d+j], x);
+		}
+	}
+	cli();
+	a = (adcind - p - d) & (N_WAVE-1);
+	if (a < 2) {
+		for (char t=0; t<TONES; t++) {
+			sre[t] += cr[a][t];
+			sim[t] += ci[a][t];
+		}
+	}
+	sei();
+}
+#endif
+
+//===================================
+//Frequency Scale Select Button, toggle the option and signal the other MCU
 
-void freqScaleFSM(void){
-	switch(freqState){
-	    //starting state
-		case Release:
-			if ( (buttons & (1<<0)) == (1<<0)) freqState = Debounce;
-			else freqState=Release;
-		break;
-		// see if button is still pressed
-		case Debounce:
-		    if((buttons & (1<<0)) == (1<<0)) freqState=Pressed;
-        	else freqState=Release;
-		break;
-		// wait for release
-		case Pressed:
-		    if ((buttons & (1<<2)) == (1<<0)) freqState=Pressed; 
-        else freqState=DebounceRel;
-		break;
-		// see if button is still released 
-		case DebounceRel:
-		    if ((buttons & (1<<0)) == (1<<0)) freqState=Pressed; 
-			else freqState=Toggle;
-		break;
-		// toggle user option value
-		case Toggle:
-			freqState=Release;
-			 // Toggle user option and signal to other MCU
-			if (freqopt == 1) {freqopt = 0; PORTB &= ~(1<<PORTB3);}
-			else {freqopt = 1; PORTB |= (1<<PORTB3);}
-		break;
+void freqToggle(void){
+	if (freqopt == 1) {freqopt = 0; PORTB &= ~(1<<PORTB3);}
+	else {freqopt = 1; PORTB |= (1<<PORTB3);}
+}
+
+//===================================
+//Build adcMask for winopt
+void makeWindow(void) {
+	for (int i=0; i<N_WAVE; i++) {
+		if (winopt == WINDOW_RECT) adcMask[i] = 0x0100;
+		else if (winopt == WINDOW_HANN) adcMask[i] = float2fix(0.5-0.5*cos(6.283*((float)i)/N_WAVE));
+		// trapezoid mask (with 1/4 length slopes)
+		else if(i<32) adcMask[i] = float2fix((8*(float)i/255));
+		else if(i >= 32 && i <= 96) adcMask[i] = 0x0100;
+		else adcMask[i] = float2fix(((128-(float)i)*8/255));
 	}
 }
+
+//===================================
+//Add specbuff into the running sum, true with the mean in specbuff
+//once 2^avgshift frames are in
+char specAverage(void) {
+	unsigned char d;
+
+	if (avgshift == 0) return 1;
+	// bring the sum and this frame to the smaller gain shift
+	if (avgcount == 0) avggain = gainshift;
+	else if (gainshift < avggain) {
+		d = 2*(avggain - gainshift);
+		for (char i=0; i<spectrum_bins; i++)
+			avgsum[i] = (d < 16) ? avgsum[i] >> d : 0;
+		avggain = gainshift;
+	}
+	d = 2*(gainshift - avggain);
+	for (char i=0; i<spectrum_bins; i++)
+		avgsum[i] += (d < 8) ? (unsigned char)specbuff[i] >> d : 0;
+	if (++avgcount < (1<<avgshift)) return 0;
+	for (char i=0; i<spectrum_bins; i++) {
+		specbuff[i] = avgsum[i] >> avgshift;
+		avgsum[i] = 0;
+	}
+	avgcount = 0;
+	gainshift = avggain;	// for the header
+	return 1;
+}
+
+//===================================
+//Apply the commands the Video MCU sent, between frames. Any command
+//starts a new averaging group.
+void cmdApply(void) {
+	unsigned char c, a;
+
+	while (cmdtail != cmdhead) {
+		c = cmdring[cmdtail];
+		cmdtail = (cmdtail + 1) & CMD_MASK;
+		a = c & 0x0f;
+		switch (c & 0xf0) {
+			case CMD_SPAN:
+				if ((a & 1) != freqopt) freqToggle();
+			break;
+			case CMD_WINDOW:
+				if (a < WINDOWS && a != winopt) {winopt = a; makeWindow();}
+			break;
+			case CMD_AVERAGE:
+				avgshift = (a > AVG_MAX) ? AVG_MAX : a;
+			break;
+			case CMD_BINS:
+				specbins = (a == 0 || a > spectrum_bins/4) ? spectrum_bins : 4*a;
+			break;
+			case CMD_PAUSE:
+				if (pauseopt && !(a & 1)) resume();
+				pauseopt = a & 1;
+			break;
+#if TRIGGER
+			case CMD_TRIGGER:
+				trigArm((a <= TRIG_SRC_BAND) ? a : 0);
+			break;
+			case CMD_TRIGLEVEL:
+				cli();	// the ISR reads triglevel
+				triglevel = (a+1) << (3+ADC_EXTRA);	// 8 to 128 in 8 bit sample units
+				sei();
+				trigthresh = (a+1) << 4;
+			break;
+			case CMD_TRIGBAND:
+				trigband = 2*a;
+			break;
+#endif
+		}
+		avgcount = 0;
+		memset(avgsum, 0, sizeof(avgsum));
+	}
+}
+
+//===================================
+//Spectrum of the block in fr[] into specbuff
+void computeSpectrum(void) {
+	int i;
+
+	// clear FFT arrays
+	memcpy(specbuff,erasespecbuff,spectrum_bins);
+	memcpy(fi,erasefi,sizeof(fi));
+	//scale the ADC values up for fixed point operation, and window with trapezoid with 32-pt slopes
+#if AGC
+	gainshift = agcShift();
+	for(i=0; i<N_WAVE; i++){
+		fr[i] = multfix((fr[i]<<gainshift),adcMask[i]);
+	}
+#else
+	for(i=0; i<N_WAVE; i++){
+		fr[i] = multfix((fr[i]<<ADC_SCALE),adcMask[i]);
+	}
+#endif
+#if SPECTRUM_MODE == SPECTRUM_GOERTZEL
+	//only the watched tones
+	goertzel();
+#else
+	//do an 128 pt FFT here
+	//save the magnitude of the the first 64 pts of the FFT into array (since all real input is reflected)
+	FFTfix(fr, fi, LOG2_N_WAVE);
+	for (i=0;i<(N_WAVE/2) && POINT_BIN(i)<specbins;i++) {
+		//Magnitude Function: Sum of Squares of the Real & Imaginary parts,
+		//stored as 8-bit values into 32 frequency bins depending on overall frequency range
+		specAdd(i, fr[i], fi[i]);
+	}
+#endif
+}
+
+//===================================
+//Coming out of pause, the samples from before it are stale
+void resume(void) {
+#if SPECTRUM_MODE == SPECTRUM_SDFT
+	unsigned char p;
+
+	// refill the ring, then resync from it before the next frame
+	for (int i=0; i<N_WAVE; i++) {
+		p = adcind;
+		while (adcind == p) ;
+	}
+	sdftframe = SDFT_RESYNC-1;
+#else
+	adcind = 0;
+#endif
+}
+
+//==================================
+//Transmit the header and 32 bytes of binned frequency data over to Video MCU
+void sendSpectrum(void) {
+	linkhdr[0] = LINK_SYNC;
+	linkhdr[1] = gainshift + ADC_EXTRA;	// in 8 bit sample units
+	linkhdr[2] = linkflags;
+#if AGC && SPECTRUM_MODE != SPECTRUM_SDFT
+	linkhdr[2] |= LINK_AGC;
+#endif
+#if DC_BLOCK
+	linkhdr[2] |= LINK_DC;
+#endif
+	linkhdr[3]++;
+	//send Tx ready signal, clear the last frame's transmit complete
+	PORTD |= (1<<PORTD6);
+	UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);	// FE0, DOR0 and UPE0 must be written 0
+	//Transmit in 4 byte packets as soon as Rx ready, header first
+	for (char j=0; j<9; j++) {
+		//wait for Rx ready signal
+		while ((PIND & (1<<PIND7)) != (1<<PIND7));
+		for (char i=0; i<4; i++) {
+			while (!(UCSR0A & _BV(UDRE0))) ;
+			if (j == 0) UDR0 = linkhdr[i];
+			else UDR0 = specbuff[currbin++] ;
+		}
+	}
+	//send Tx not ready signal after transmit complete
+	while (!(UCSR0A & _BV(TXC0)));
+	PORTD &= ~(1<<PORTD6);
+	currbin=0;
+}
 
+//==================================
+//While paused, answer Rx Ready with a header packet flagged LINK_IDLE,
+//which is what clocks the Video MCU's commands in
+void sendIdle(void) {
+	if ((PIND & (1<<PIND7)) != (1<<PIND7)) return;
+	linkhdr[0] = LINK_SYNC;
+	linkhdr[1] = gainshift + ADC_EXTRA;
+	linkhdr[2] = LINK_IDLE;
+	PORTD |= (1<<PORTD6);
+	UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);
+	for (char i=0; i<4; i++) {
+		while (!(UCSR0A & _BV(UDRE0))) ;
+		UDR0 = linkhdr[i];
+	}
+	//the command bytes shift in with ours, so they are in when this is done
+	while (!(UCSR0A & _BV(TXC0)));
+	PORTD &= ~(1<<PORTD6);
+}
+
+#if TRIGGER
+//==================================
+//Arm the trigger for src, or turn it off. Arming again before the burst
+//is out only changes the source.
+void trigArm(unsigned char src) {
+	cli();
+	trigsource = src;
+	if (trigstate != TRIG_HELD) {
+		trigstate = src ? TRIG_FILL : TRIG_OFF;
+		trigcount = TRIG_PRE*N_WAVE;
+	}
+	sei();
+}
+
+//==================================
+//Send the frozen ring as TRIG_BLOCKS frames, oldest first, each with its
+//own gain, then disarm and start on a fresh block
+void sendBurst(void) {
+	unsigned int p = trigind;
+
+	avgcount = 0;
+	memset(avgsum, 0, sizeof(avgsum));
+	linkhdr[3] = 0xff;		// so the burst counts from 0
+	for (unsigned char b=0; b<TRIG_BLOCKS; b++) {
+		for (int i=0; i<N_WAVE; i++) {
+			fr[i] = trigring[p];
+			p = (p + 1) & TRIG_MASK;
+		}
+		computeSpectrum();
+		linkflags = (b == TRIG_BLOCKS-1) ? LINK_TRIG|LINK_LAST : LINK_TRIG;
+		sendSpectrum();
+	}
+	linkflags = 0;
+	trigstate = TRIG_OFF;
+	adcind = 0;
+}
+#endif
+
+#if PAUSE_SLEEP
+//==================================
+//Power down until Rx Ready, then wait for it and send the idle header.
+//The timer and ADC are stopped for the sleep and run again after it,
+//the command that woke us decides whether we stay paused.
+void pauseSleep(void) {
+	unsigned char timsk = TIMSK1, adcsra = ADCSRA;
+
+	TIMSK1 = 0;			// no sample or sleep ISRs
+	ADCSRA = 0;			// the ADC draws current while powered down
+	cli();
+	PCIFR = (1<<PCIF3);	// PD7 changes every line while running
+	if ((PIND & (1<<PIND7)) != (1<<PIND7)) {
+		PCMSK3 = (1<<PCINT31);
+		PCICR |= (1<<PCIE3);
+		set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		PCICR &= ~(1<<PCIE3);
+	}
+	sei();
+	// the sleep ISR needs idle mode back before the timer runs
+	set_sleep_mode(SLEEP_MODE_IDLE);
+#if ADC_COMPLETE_ISR
+	sleep_disable();
+#endif
+	// wake up takes longer than Rx Ready stays up, it comes back next blank line
+	while ((PIND & (1<<PIND7)) != (1<<PIND7)) ;
+	sendIdle();
+	ADCSRA = adcsra | (1<<ADSC);
+	TIMSK1 = timsk;
+}
+#endif
+
 //==================================         
 // set up the ports and timers
 int main() {
   //init timer 1 to sample audio
   // TIMER 1: OC1* disconnected, CTC mode, fosc/1 (16MHz), OC1A and OC1B interrupts enabled
   TCCR1B = _BV(WGM12) | _BV(CS10);
-  OCR1A = ADC_TIME;	// time for one ADC sample
-  OCR1B = SLEEP_TIME;	// time to go to sleep
+  OCR1A = SAMPLE_TIME;	// time for one ADC conversion
+  OCR1B = SAMPLE_TIME-(ADC_TIME-SLEEP_TIME);	// time to go to sleep
+#if ADC_COMPLETE_ISR
+  TIMSK1 = 0;			// compare B only triggers the ADC
+#else
   TIMSK1 = _BV(OCIE1B) | _BV(OCIE1A);
+#endif
 
   //init ports
   DDRD |= (1<<DDD6) | (1<<DDD1);		// USART Ports to transmit to other microcontroller
   PORTD = 0x00;							// Turn off pull-up resistors
+  PORTD |= _BV(PORTD0);					// except RXD0, so it idles high without the command wire
   DDRC = 0x00;							// push button ports
   PORTC = 0x01;							// pull up resistors on ports with buttons
   DDRB |= (1<<DDB3);					// push button "acknowledge" output signal to other MCU
@@ -228,20 +945,58 @@ int main() {
 
   // USART in Synchronous mode, transmitter enabled, frequency 2Mbps
   DDRB |= (1<<DDB0);									// Enable output on USART0 Clock Pin
-  UCSR0B = _BV(TXEN0);									// Enable transmit
+  UCSR0B = _BV(TXEN0) | _BV(RXEN0) | _BV(RXCIE0);		// Enable transmit, and receive commands
   UCSR0C = _BV(UMSEL00) | (1<<UCSZ01) | (1<<UCSZ00);	// Enable USART Synchronous Mode with 8-bit character size
   UBRR0L = 2 ;											// Set transmit rate to 2 Mbps
 
   ///////////////////////
   // Set up the ADC
+#if ADC_BITS > 8
+  ADMUX = (1<<REFS1)|(1<<REFS0)+0;							// Right adjusted result, 2.56V Voltage Reference and ADC Port 0
+#else
   ADMUX = (1<<ADLAR)|(1<<REFS1)|(1<<REFS0)+0;				// Enable ADC Left Adjust Result and 2.56V Voltage Reference and ADC Port 0
-  ADCSRA = ((1<<ADEN)|(1<<ADSC))+7; 						// Runs at 125kHz, corresponds to 8-bit precision
+#endif
+#if ADC_TRIGGER == ADC_TRIGGER_ISR
+  ADCSRA = ((1<<ADEN)|(1<<ADSC))+ADC_PRESCALE; 				// first conversion, the ISR starts the rest
+#else
+  ADCSRB = (ADC_TRIGGER == ADC_TRIGGER_TIMER) ? 5 : 0;		// ADTS: Timer1 compare B or free running
+#if ADC_COMPLETE_ISR
+  ADCSRA = ((1<<ADEN)|(1<<ADSC)|(1<<ADATE)|(1<<ADIE))+ADC_PRESCALE;	// auto trigger, interrupt when done
+#else
+  ADCSRA = ((1<<ADEN)|(1<<ADSC)|(1<<ADATE))+ADC_PRESCALE;	// auto trigger
+#endif
+#endif
   adcind=0;		// initialize array indexes
+#if OVERSAMPLE > 1
+  osacc=0;
+  oscount=OVERSAMPLE;
+#endif
   currbin=0;
+  gainshift=ADC_SCALE;
+  dcacc=DC_OFFSET<<DC_SHIFT;	// start from the nominal bias
+  linkhdr[3]=0;
 
   // Buttons
   freqopt=1;	//set frequency range to 2 kHz initially
-  freqState = Release;
+  buttontick = BUTTON_TICKS;
+
+  // Commands and the options they set
+  cmdhead=0;
+  cmdtail=0;
+  winopt=WINDOW_TRAPEZOID;
+  avgshift=0;
+  avgcount=0;
+  specbins=spectrum_bins;
+  pauseopt=0;
+  linkflags=0;
+#if TRIGGER
+  trigind=0;
+  trigstate=TRIG_OFF;
+  trigsource=0;
+  triglevel=8<<(3+ADC_EXTRA);
+  trigthresh=128;
+  trigband=0;
+#endif
   
   //loop iterator
   int i;
@@ -251,63 +1006,89 @@ int main() {
     Sinewave[i] = float2fix(sin(6.283*((float)i)/N_WAVE)); 
 	// generate empty array to erase
 	erasefi[i]=0;
-	// generate trapezoid mask (with 1/4 length slopes) for ADC buffer
-	if(i<32) adcMask[i] = float2fix((8*(float)i/255));
-	else if(i >= 32 && i <= 96) adcMask[i] = 0x0100;
-	else if(i > 96) adcMask[i] = float2fix(((128-(float)i)*8/255));
   }
+  // window for the ADC buffer
+  makeWindow();
   // generate empty array to erase
   for (i=0; i<spectrum_bins; i++)
 	erasespecbuff[i]=0;
+#if SPECTRUM_MODE == SPECTRUM_GOERTZEL
+  // cosine and sine of each tone from the sine table
+  for (i=0; i<TONES; i++) {
+	gcos[i] = Sinewave[toneBins[i]+N_WAVE/4];
+	gsin[i] = Sinewave[toneBins[i]];
+  }
+#elif SPECTRUM_MODE == SPECTRUM_SDFT
+  // damped twiddles, finer than Sinewave so the ISR's rotation stays
+  // well inside the damping
+  for (i=0; i<TONES; i++) {
+	scos[i] = (int)floor(16384.0*SDFT_R*cos(6.2831853*toneBins[i]/N_WAVE) + 0.5);
+	ssin[i] = (int)floor(16384.0*SDFT_R*sin(6.2831853*toneBins[i]/N_WAVE) + 0.5);
+	sre[i] = 0;
+	sim[i] = 0;
+  }
+  for (i=0; i<=N_WAVE; i++)
+	sdftDamp[i] = float2fix(pow(SDFT_R,i));
+  srn = (int)floor(16384.0*pow(SDFT_R,N_WAVE) + 0.5);
+  for (i=0; i<2*N_WAVE; i++)
+	adcbuff[i]=0;
+  sdftframe=0;
+#endif
 
   // Set up single ADC timing with sleep mode
   sei();
+#if !ADC_COMPLETE_ISR
   set_sleep_mode(SLEEP_MODE_IDLE);
   sleep_enable();
+#endif
 
   while(1) {
-	// store Port C and update button press FSM
-    buttons=PINC;
-	freqScaleFSM();
+	// run the option handlers of buttons the sample ISR saw released
+	if (btnevents) buttons_run(fftButtons, BUTTONS);
+	// and the Video MCU's commands, this is always between frames
+	if (cmdtail != cmdhead) cmdApply();
+	if (pauseopt) {
+#if PAUSE_SLEEP
+		pauseSleep();
+#else
+		sendIdle();
+#endif
+		continue;
+	}
+#if SPECTRUM_MODE == SPECTRUM_SDFT
+	// the bins are always current, send them whenever the link is free
+	if (++sdftframe >= SDFT_RESYNC) {
+		sdftframe = 0;
+		sdft_resync();
+	}
+	sdft_spectrum();
+	if (specAverage()) sendSpectrum();
+#else
+#if TRIGGER
+	// a captured burst goes out before the next frame
+	if (trigstate == TRIG_HELD) {
+		sendBurst();
+		continue;
+	}
+#endif
 	// if ADC buffer is full...
   	if (adcind >= N_WAVE) {
-		// clear FFT arrays
-		memcpy(specbuff,erasespecbuff,spectrum_bins);
-		memcpy(fi,erasefi,N_WAVE);
 		// copy ADC buffer into separate array
-		memcpy(fr,adcbuff,N_WAVE);
-		//scale the ADC values up for fixed point operation, and window with trapezoid with 32-pt slopes
-		for(i=0; i<N_WAVE; i++){
-			fr[i] = multfix((fr[i]<<4),adcMask[i]);
-		}
-		//do an 128 pt FFT here
-		//save the magnitude of the the first 64 pts of the FFT into array (since all real input is reflected)
-		FFTfix(fr, fi, LOG2_N_WAVE);
-		for (i=0;i<(N_WAVE/2);i++) {
-			//Magnitude Function: Sum of Squares of the Real & Imaginary parts
-			fftarray[i]=multfix(fr[i],fr[i])+multfix(fi[i],fi[i]);
-			//store 8-bit values into 32 frequency bins depending on overall frequency range
-			if (freqopt==0) specbuff[(char)(i/2)]+=(char)(fftarray[i]);
-			else if (freqopt==1 && i<32) specbuff[i]+=(char)(fftarray[i]);
-		}
-		//Transmit the 32 bytes of binned frequency data over to Video MCU
-		//send Tx ready signal
-		PORTD |= (1<<PORTD6);
-		//Transmit in 4 byte packets as soon as Rx ready
-		for (int j=0; j<8; j++) {
-			//wait for Rx ready signal
-			while ((PIND & (1<<PIND7)) != (1<<PIND7));
-			for (i=0; i<4; i++) {
-				while (!(UCSR0A & _BV(UDRE0))) ;
-				UDR0 = specbuff[currbin++] ;
-    	    }
+		memcpy(fr,adcbuff,sizeof(fr));
+		computeSpectrum();
+#if TRIGGER
+		// the band trigger looks at every frame, before averaging
+		if (trigstate == TRIG_ARMED && trigsource == TRIG_SRC_BAND &&
+			(unsigned char)specbuff[trigband] + (unsigned char)specbuff[trigband+1] > trigthresh) {
+			cli();
+			if (trigstate == TRIG_ARMED) trigFire();
+			sei();
 		}
-		//send Tx not ready signal after transmit complete
-		while (!(UCSR0A & _BV(TXC0)));
-		PORTD &= ~(1<<PORTD6);
-		//reset array indexes to start acquiring data again
-		currbin=0;
+#endif
+		if (specAverage()) sendSpectrum();
+		//reset array index to start acquiring data again
 		adcind=0;
 	}  //if
+#endif
   }  //while
 }  //main
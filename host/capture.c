@@ -0,0 +1,134 @@
+// ECE 4760 Final Project: spectrum capture files, see capture.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+
+struct capture_writer {
+	FILE *fp;
+	capture_header hdr;
+	uint64_t time0, last;
+	uint64_t *index;
+	uint32_t nindex, maxindex;
+};
+
+capture_writer *capture_create(const char *path, int freqopt, int scale) {
+	capture_writer *w = calloc(1, sizeof(*w));
+	if (!w) return NULL;
+	if (!(w->fp = fopen(path, "wb"))) {
+		free(w);
+		return NULL;
+	}
+	memcpy(w->hdr.magic, CAP_MAGIC, 8);
+	w->hdr.version = CAP_VERSION;
+	w->hdr.header_size = CAP_HEADER;
+	w->hdr.sample_rate = 8000;
+	w->hdr.n_wave = SPEC_N_WAVE;
+	w->hdr.bins = SPEC_BINS;
+	w->hdr.freqopt = freqopt;
+	w->hdr.bin_width = freqopt ? 1 : 2;
+	w->hdr.scale = scale;
+	w->hdr.stride = sizeof(capture_frame);
+	w->hdr.bins_offset = offsetof(capture_frame, bins);
+	w->hdr.frames_offset = CAP_HEADER;
+	w->hdr.index_step = CAP_INDEX_STEP;
+	// header goes in last, once the counts are known
+	fwrite(&w->hdr, 1, CAP_HEADER, w->fp);
+	return w;
+}
+
+int capture_write(capture_writer *w, uint64_t time, int gain, int flags, const uint8_t *bins) {
+	capture_frame f;
+
+	if (w->hdr.count == 0) w->time0 = time;
+	else if (time < w->last) return -1;	// the index needs ordered times
+	w->last = time;
+	// an index entry for every step boundary up to this frame
+	while ((uint64_t)w->nindex * w->hdr.index_step <= time - w->time0) {
+		if (w->nindex == w->maxindex) {
+			w->maxindex = w->maxindex ? w->maxindex * 2 : 256;
+			w->index = realloc(w->index, w->maxindex * sizeof(uint64_t));
+		}
+		w->index[w->nindex++] = w->hdr.count;
+	}
+	memset(&f, 0, sizeof(f));
+	f.time = time - w->time0;
+	f.gain = gain;
+	f.flags = flags;
+	memcpy(f.bins, bins, SPEC_BINS);
+	if (fwrite(&f, sizeof(f), 1, w->fp) != 1) return -1;
+	w->hdr.count++;
+	return 0;
+}
+
+int capture_close(capture_writer *w) {
+	int err = 0;
+
+	w->hdr.index_offset = CAP_HEADER + w->hdr.count * sizeof(capture_frame);
+	w->hdr.index_count = w->nindex;
+	if (fwrite(w->index, sizeof(uint64_t), w->nindex, w->fp) != w->nindex) err = -1;
+	if (fseek(w->fp, 0, SEEK_SET) || fwrite(&w->hdr, 1, CAP_HEADER, w->fp) != CAP_HEADER) err = -1;
+	if (fclose(w->fp)) err = -1;
+	free(w->index);
+	free(w);
+	return err;
+}
+
+int capture_open(capture *c, const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	memset(c, 0, sizeof(*c));
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) || (size_t)st.st_size < CAP_HEADER) {
+		close(fd);
+		return -1;
+	}
+	c->size = st.st_size;
+	c->map = mmap(NULL, c->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		return -1;
+	}
+	c->hdr = c->map;
+	// reject anything this reader would index out of bounds, every product
+	// is checked against the file size before it is formed so none overflows
+	if (memcmp(c->hdr->magic, CAP_MAGIC, 8) || c->hdr->version != CAP_VERSION
+		|| c->hdr->header_size != CAP_HEADER || c->hdr->stride != sizeof(capture_frame)
+		|| c->hdr->bins != SPEC_BINS || c->hdr->index_step == 0
+		|| (c->hdr->count > 0 && c->hdr->index_count == 0)
+		|| c->hdr->frames_offset < CAP_HEADER || c->hdr->frames_offset > c->size
+		|| c->hdr->frames_offset % sizeof(uint64_t)
+		|| c->hdr->count > (c->size - c->hdr->frames_offset) / c->hdr->stride
+		|| c->hdr->index_offset != c->hdr->frames_offset + c->hdr->count * c->hdr->stride
+		|| c->hdr->index_count > (c->size - c->hdr->index_offset) / sizeof(uint64_t)) {
+		capture_unmap(c);
+		return -1;
+	}
+	c->frames = (const capture_frame *)((const char *)c->map + c->hdr->frames_offset);
+	c->index = (const uint64_t *)((const char *)c->map + c->hdr->index_offset);
+	return 0;
+}
+
+void capture_unmap(capture *c) {
+	if (c->map) munmap(c->map, c->size);
+	memset(c, 0, sizeof(*c));
+}
+
+uint64_t capture_seek(const capture *c, uint64_t t) {
+	uint64_t k = t / c->hdr->index_step, i;
+
+	if (c->hdr->count == 0) return 0;
+	if (k >= c->hdr->index_count) {
+		// past the last index entry, at most one step of frames to scan
+		i = c->index[c->hdr->index_count - 1];
+	} else i = c->index[k];
+	while (i < c->hdr->count && c->frames[i].time < t) i++;
+	return i;
+}
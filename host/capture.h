@@ -0,0 +1,86 @@
+// ECE 4760 Final Project: spectrum capture files
+//
+// A capture holds the frames seen on the FFT->video link. The layout is
+// fixed so a reader maps the file and indexes it directly, with no parsing:
+//
+//   header	CAP_HEADER bytes, capture_header below
+//   frames	count records of stride bytes, frame i at frames_offset + i*stride
+//   index	index_count uint64 frame numbers, entry k is the first frame at
+//			or after time0 + k*index_step microseconds
+//
+// All fields are little endian, which both host targets are, so the
+// structures below are the file contents. Bins sit at a fixed offset in
+// every record, so one bin across all frames is a strided column.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "spectrum.h"
+
+#define CAP_MAGIC "SPECCAP1"
+#define CAP_VERSION 1
+#define CAP_HEADER 64
+#define CAP_INDEX_STEP 100000	// default index spacing, 100 ms
+
+typedef struct {
+	char magic[8];
+	uint16_t version;		// CAP_VERSION
+	uint16_t header_size;	// CAP_HEADER
+	uint32_t sample_rate;	// ADC rate in Hz, 8000
+	uint16_t n_wave;		// FFT length, N_WAVE
+	uint16_t bins;			// bins per frame, spectrum_bins
+	uint8_t freqopt;		// 0: 4 kHz span, 1: 2 kHz span
+	uint8_t bin_width;		// FFT points summed per bin (2 or 1)
+	uint8_t scale;			// ADC pre-scale shift, ADC_SCALE (gains are in 8 bit units)
+	uint8_t reserved0;
+	uint16_t stride;		// bytes per record
+	uint16_t bins_offset;	// offset of bins within a record
+	uint32_t reserved1;
+	uint64_t count;			// frames
+	uint64_t frames_offset;
+	uint64_t index_offset;
+	uint32_t index_count;
+	uint32_t index_step;	// microseconds between index entries
+} capture_header;
+
+typedef struct {
+	uint64_t time;			// microseconds since the start of the capture
+	uint8_t gain;			// gain shift applied by the FFT MCU
+	uint8_t flags;			// link header flags, SPEC_LINK_AGC
+	uint8_t reserved[6];
+	uint8_t bins[SPEC_BINS];
+} capture_frame;
+
+// the file layout depends on these
+_Static_assert(sizeof(capture_header) == CAP_HEADER, "capture_header must be CAP_HEADER bytes");
+_Static_assert(sizeof(capture_frame) == 48, "capture_frame must be 48 bytes");
+
+typedef struct capture_writer capture_writer;
+
+typedef struct {
+	const capture_header *hdr;
+	const capture_frame *frames;
+	const uint64_t *index;
+	void *map;
+	size_t size;
+} capture;
+
+// Writing: frames are appended, the index is added and the header
+// completed by capture_close(). Returns NULL or -1 on errors.
+capture_writer *capture_create(const char *path, int freqopt, int scale);
+int capture_write(capture_writer *w, uint64_t time, int gain, int flags, const uint8_t *bins);
+int capture_close(capture_writer *w);
+
+// Reading
+int capture_open(capture *c, const char *path);
+void capture_unmap(capture *c);
+// first frame at or after time t (count if past the end), O(1) via the index
+uint64_t capture_seek(const capture *c, uint64_t t);
+
+static inline const capture_frame *capture_at(const capture *c, uint64_t i) {
+	return &c->frames[i];
+}
+
+#endif
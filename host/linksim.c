@@ -0,0 +1,399 @@
+// ECE 4760 Final Project: FFT->video link simulator
+//
+// Cycle by cycle model of the two MCUs' link code: fft.c acquiring,
+// computing and blasting 4 byte packets on Rx Ready (PD7), video.c's sync
+// ISR dropping PD7 on every line, raising it on blank lines from rx_ready()
+// while the FFT MCU has Tx Ready (PD6) up and Timer2 dropping it at the cutoff,
+// the receive ISR filling the ring and main draining it into hist, drawing
+// and waiting for the buffer swap. It reports the frame rates, link use,
+// FFT stalls and the handshake faults that would otherwise only show on
+// the boards.
+//
+//   gcc -O2 -o linksim linksim.c
+//   linksim [-t seconds] [-c fft cycles] [-d draw cycles] [-u ubrr]
+//           [-x rx cutoff] [-z ring size] [-s] [-a] [-o oversample]
+//           [-i sample isr] [-j sum isr] [-p pause seconds]
+//
+// The cycle costs are estimates of the compiled code; change them with
+// the options to see how much headroom the handshake has. -s models the
+// FRAME_SINGLE build, which draws without waiting for a buffer swap.
+// -a models fft.c's ADC_COMPLETE_ISR build, where the sample ISR no longer
+// has to be entered from sleep and main only loses the ISR itself.
+// -o 4 models OVERSAMPLE: four conversions per sample, each summed by a
+// short ISR call. The sample ISR costs (-i, and -j for the summing calls)
+// are estimates, not counted from a compiled .lss; set them from one.
+// -p presses the run button a quarter into the run and again that many
+// seconds later. The CMD_PAUSE commands only go out on the link clock, so
+// the paused FFT MCU (PAUSE_SLEEP, powered down until Rx Ready) has to be
+// woken for the resume; it fails if the FFT MCU never resumes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// video.c
+#define LINE_TIME 1018		// cycles per line, Timer1 TOP + 1 ... nearly
+#define SLEEP_TIME 999		// main sleeps here until the next sync
+#define LINES 262			// LineCount runs 1..262
+#define SCREEN_TOP 30
+#define SCREEN_BOT 230
+#define LINK_FRAME 36		// header packet and 32 bins
+#define BLANK_ISR 120		// sync ISR cycles on a blank line, up to rx_ready()
+#define DISPLAY_ISR 860		// sync ISR cycles on a display line
+#define RX_ISR 45			// receive ISR cycles
+#define DRAIN_BYTE 14		// main cycles to move a byte from the ring to hist
+
+// fft.c
+#define ADC_TIME 2000		// cycles per sample
+#define N_WAVE 128
+#define POLL 6				// cycles per turn of the Rx Ready wait loop
+#define FFT_SLEEP_TIME 1975	// the sleep ISR holds main from here to the sample
+#define WAKE_TIME 16384		// power down start up, 16K CK for the crystal
+#define RING_MAX 1024
+
+static long rx_cutoff = 450, ring_size = 64, fft_cycles = 90000, draw_cycles = 60000;
+static int ubrr = 2, single = 0, adc_isr = 0, oversample = 1;
+static int sample_isr = 40;	// sample ISR cycles, adc_sample() and the DC blocker
+static int sum_isr = 35;	// sample ISR cycles when it only sums a conversion
+static long pause_at = -1, resume_at = -1;	// run button presses
+
+// video MCU
+static int line = 1, pd7;
+static long ring_count, ring_max, rxpkt;
+static int main_state, currbin, swapreq;
+static long main_left;		// cycles left in the current main step
+static long sync_left;		// cycles left in the sync ISR
+static long rxisr_left;		// cycles left in receive ISRs
+static int runopt = 1;
+static int cmd_queued, cmd_val;	// txtail != txhead || !TXC1, and the CMD_PAUSE bit
+static char ringtag[RING_MAX];	// 1 for the bytes of an idle header
+static long ring_in, ring_out;
+enum {DRAIN, DRAW, SWAP};
+
+// FFT MCU
+static int fft_state, adcind, packet, sent;
+static long fft_left, shift_left, stall, held;
+static int shift_pending;	// bytes written to UDR0 not yet shifted out
+static int fft_cmd = -1;	// CMD_PAUSE bit received, applied between frames
+enum {ACQ, COMPUTE, WAIT_RDY, SEND, FLUSH, SLEEP, WAKE, IDLE_RDY, IDLE_SEND, IDLE_FLUSH};
+
+// results
+static long frames_sent, frames_drawn, fields, bytes, busy_cycles;
+static long late, overruns, ready_raised;
+static long frames_dropped, idles, resumed = -1;
+static long stamp[8], latency, latency_max;	// last sample times of frames in flight
+static int stamp_in, stamp_out;
+
+static int blank(void) {return line < SCREEN_TOP || line >= SCREEN_BOT;}
+
+// Tx Ready is up from sendSpectrum() or sendIdle() until the last byte is out
+static int pd6(void) {
+	return fft_state == WAIT_RDY || fft_state == SEND || fft_state == FLUSH
+		|| fft_state == IDLE_SEND || fft_state == IDLE_FLUSH;
+}
+
+static void rx_ready(long tcnt) {
+	// a waiting command needs the link clock even without Tx Ready
+	if (!pd6() && !cmd_queued) return;
+	if (ring_size - ring_count >= 4 && tcnt < rx_cutoff) {
+		pd7 = 1;
+		ready_raised++;
+	}
+}
+
+// a byte has finished shifting into USART1, and a command out of it
+static void rx_byte(long tcnt, int idle) {
+	bytes++;
+	if (cmd_queued) {
+		cmd_queued = 0;
+		fft_cmd = cmd_val;
+	}
+	// the receive ISR only runs right when the CPU is awake and free;
+	// a byte after the sleep wakes it and delays the next sync ISR
+	if (tcnt >= SLEEP_TIME - RX_ISR) late++;
+	rxisr_left += RX_ISR;
+	pd7 = 0;
+	if (ring_count == ring_size) overruns++;
+	else {
+		ring_count++;
+		ringtag[ring_in++ % RING_MAX] = idle;
+	}
+	if (ring_count > ring_max) ring_max = ring_count;
+	if ((++rxpkt & 3) == 0 && blank()) rx_ready(tcnt);
+}
+
+static void video_main(long now) {
+	switch (main_state) {
+	case DRAIN:
+		if (ring_count == 0) return;
+		if (--main_left > 0) return;
+		ring_count--;
+		main_left = DRAIN_BYTE;
+		// a paused FFT MCU only sends the header
+		if (ringtag[ring_out++ % RING_MAX]) {
+			if (++currbin == LINK_FRAME - 32) currbin = 0;
+			break;
+		}
+		if (++currbin == LINK_FRAME && !runopt) {
+			// frames still in flight when paused are dropped
+			frames_dropped++;
+			stamp_out++;
+			currbin = 0;
+			break;
+		}
+		if (currbin == LINK_FRAME) {
+			main_state = DRAW;
+			main_left = draw_cycles;
+		}
+		break;
+	case DRAW:
+		if (--main_left > 0) return;
+		frames_drawn++;
+		{
+			long l = now - stamp[stamp_out++ & 7];
+			latency += l;
+			if (l > latency_max) latency_max = l;
+		}
+		if (single) {
+			currbin = 0;
+			main_state = DRAIN;
+			main_left = DRAIN_BYTE;
+		} else {
+			swapreq = 1;
+			main_state = SWAP;
+		}
+		break;
+	case SWAP:
+		if (swapreq) return;
+		currbin = 0;
+		main_state = DRAIN;
+		main_left = DRAIN_BYTE;
+		break;
+	}
+}
+
+static void video_cycle(long now) {
+	long tcnt = now % LINE_TIME;
+
+	// runToggle(): a resume starts on a fresh frame, the command goes out
+	// with whatever the FFT MCU clocks next
+	if (now == pause_at || now == resume_at) {
+		runopt = now == resume_at;
+		if (runopt) {
+			ring_out = ring_in;
+			ring_count = 0;
+			if (main_state == DRAIN) currbin = 0;
+		}
+		cmd_queued = 1;
+		cmd_val = !runopt;
+	}
+	if (tcnt == 0) {
+		// sync ISR: PORTD = syncON drops Rx Ready with the sync pin
+		if (++line > LINES) {
+			line = 1;
+			fields++;
+		}
+		pd7 = 0;
+		sync_left = blank() ? BLANK_ISR : DISPLAY_ISR;
+	}
+	// Timer2 times Rx Ready out
+	if (tcnt == rx_cutoff) pd7 = 0;
+	if (sync_left > 0) {
+		if (--sync_left == 0 && blank()) {
+			// end of the blank line sync ISR: swap, then ask for a packet
+			swapreq = 0;
+			rx_ready(tcnt);
+		}
+		return;
+	}
+	if (rxisr_left > 0) {
+		rxisr_left--;
+		return;
+	}
+	if (tcnt < SLEEP_TIME) video_main(now);
+}
+
+// main is asleep or in the sample ISR; where the ISR falls in the
+// conversion period does not matter here
+static int fft_held(long now) {
+	long period = ADC_TIME / oversample, phase = now % period;
+
+	if (!adc_isr && phase >= period - (ADC_TIME - FFT_SLEEP_TIME)) return 1;
+	return phase < ((now % ADC_TIME < period) ? sample_isr : sum_isr);
+}
+
+// pauseSleep() only powers down if Rx Ready is not already up
+static void pause_sleep(void) {
+	fft_state = pd7 ? IDLE_RDY : SLEEP;
+}
+
+static void fft_cycle(long now) {
+	long byte_cycles = 10 * 2 * (ubrr + 1);	// start, 8 data and stop bits
+	// pauseSleep() stops the timer, so no sample ISR while paused
+	int hold = (fft_state >= SLEEP) ? 0 : fft_held(now);
+
+	// the USART shifter
+	if (shift_left > 0) {
+		busy_cycles++;
+		if (--shift_left == 0) rx_byte(now % LINE_TIME, fft_state >= IDLE_SEND);
+	}
+	if (shift_left == 0 && shift_pending > 0) {
+		shift_pending--;
+		shift_left = byte_cycles;
+	}
+	if (hold) held++;
+
+	switch (fft_state) {
+	case ACQ:
+		// cmdApply() runs in the main loop between frames
+		if (fft_cmd >= 0 && !hold) {
+			int pause = fft_cmd;
+
+			fft_cmd = -1;
+			if (pause) {
+				pause_sleep();
+				break;
+			}
+		}
+		// one sample per Timer1 period while the buffer fills
+		if (now % ADC_TIME == 0 && ++adcind == N_WAVE) {
+			stamp[stamp_in++ & 7] = now;
+			fft_state = COMPUTE;
+			fft_left = fft_cycles;
+		}
+		break;
+	case COMPUTE:
+		if (hold) break;
+		if (--fft_left == 0) {
+			fft_state = WAIT_RDY;
+			packet = 0;
+		}
+		break;
+	case WAIT_RDY:
+		// PIND is read once per turn of the polling loop
+		if (hold || now % POLL != 0 || !pd7) {
+			stall++;
+			break;
+		}
+		fft_state = SEND;
+		sent = 0;
+		break;
+	case SEND:
+		// UDR0 takes a byte whenever it is empty (one waiting, one shifting)
+		if (!hold && shift_pending == 0) {
+			shift_pending = 1;
+			if (++sent == 4) {
+				fft_state = (++packet == LINK_FRAME/4) ? FLUSH : WAIT_RDY;
+			}
+		}
+		break;
+	case FLUSH:
+		if (shift_left == 0 && shift_pending == 0) {
+			frames_sent++;
+			adcind = 0;
+			fft_state = ACQ;
+		}
+		break;
+	case SLEEP:
+		// powered down, the PD7 pin change wakes it
+		if (pd7) {
+			fft_state = WAKE;
+			fft_left = WAKE_TIME;
+		}
+		break;
+	case WAKE:
+		// longer than Rx Ready stays up, so it waits for the next one
+		if (--fft_left == 0) fft_state = IDLE_RDY;
+		break;
+	case IDLE_RDY:
+		if (now % POLL != 0 || !pd7) break;
+		fft_state = IDLE_SEND;
+		sent = 0;
+		break;
+	case IDLE_SEND:
+		if (shift_pending == 0) {
+			shift_pending = 1;
+			if (++sent == 4) fft_state = IDLE_FLUSH;
+		}
+		break;
+	case IDLE_FLUSH:
+		if (shift_left == 0 && shift_pending == 0) {
+			idles++;
+			if (fft_cmd == 0) {
+				// resume(): start over with fresh samples
+				if (resumed < 0) resumed = now;
+				adcind = 0;
+				fft_state = ACQ;
+			} else pause_sleep();
+			fft_cmd = -1;
+		}
+		break;
+	}
+}
+
+int main(int argc, char **argv) {
+	double seconds = 10, pause = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:c:d:u:x:z:sao:i:j:p:")) != -1) {
+		switch (opt) {
+		case 't': seconds = atof(optarg); break;
+		case 'c': fft_cycles = atol(optarg); break;
+		case 'd': draw_cycles = atol(optarg); break;
+		case 'u': ubrr = atoi(optarg); break;
+		case 'x': rx_cutoff = atol(optarg); break;
+		case 'z': ring_size = atol(optarg); break;
+		case 's': single = 1; break;
+		case 'a': adc_isr = 1; break;
+		case 'o': oversample = atoi(optarg); break;
+		case 'i': sample_isr = atoi(optarg); break;
+		case 'j': sum_isr = atoi(optarg); break;
+		case 'p': pause = atof(optarg); break;
+		default:
+			fprintf(stderr, "usage: linksim [-t seconds] [-c fft cycles] [-d draw cycles] [-u ubrr] [-x rx cutoff] [-z ring size] [-s] [-a] [-o oversample] [-i sample isr] [-j sum isr] [-p pause seconds]\n");
+			return 2;
+		}
+	}
+	if (fft_cycles < 1 || draw_cycles < 1 || ring_size < 4 || ring_size > RING_MAX || ubrr < 0) return 2;
+	if (oversample != 1 && oversample != 4) return 2;
+	if (sample_isr < 1 || sum_isr < 1) return 2;
+
+	long total = (long)(seconds * 16e6);
+	if (pause > 0) {
+		pause_at = total / 4;
+		resume_at = pause_at + (long)(pause * 16e6);
+		if (resume_at >= total) return 2;
+	}
+	for (long now = 0; now < total; now++) {
+		video_cycle(now);
+		fft_cycle(now);
+	}
+
+	printf("simulated        %.2f s\n", seconds);
+	printf("video fields     %.2f /s\n", fields / seconds);
+	printf("frames sent      %.2f /s\n", frames_sent / seconds);
+	printf("frames drawn     %.2f /s\n", frames_drawn / seconds);
+	if (frames_drawn)
+		printf("frame latency    %.2f ms mean, %.2f ms max  (last sample to drawn)\n",
+			latency / 16e3 / frames_drawn, latency_max / 16e3);
+	printf("link use         %.2f %%  (%ld bytes)\n", 100.0 * busy_cycles / total, bytes);
+	printf("fft stalled      %.2f %%  waiting for Rx Ready\n", 100.0 * stall / total);
+	printf("fft main held    %.2f %%  by the sample ISR%s\n", 100.0 * held / total,
+		adc_isr ? "" : " and sleep");
+	printf("sample ISR       %d of %d cycles per conversion, estimated%s\n",
+		sample_isr + (adc_isr ? 0 : ADC_TIME - FFT_SLEEP_TIME), ADC_TIME / oversample,
+		sample_isr + (adc_isr ? 0 : ADC_TIME - FFT_SLEEP_TIME) >= ADC_TIME / oversample ? "  OVER BUDGET" : "");
+	printf("rx ready raised  %ld\n", ready_raised);
+	printf("ring peak        %ld of %ld\n", ring_max, ring_size);
+	printf("late bytes       %ld  (would delay a sync pulse)\n", late);
+	printf("ring overruns    %ld  (lost bytes)\n", overruns);
+	if (pause_at >= 0) {
+		printf("paused frames    %ld dropped, %ld idle headers\n", frames_dropped, idles);
+		if (resumed >= 0)
+			printf("resumed          %.2f ms after the button\n", (resumed - resume_at) / 16e3);
+		else
+			printf("resumed          NEVER  (the resume command was not clocked out)\n");
+	}
+	return (late || overruns || (pause_at >= 0 && resumed < 0)) ? 1 : 0;
+}
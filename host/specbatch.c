@@ -0,0 +1,314 @@
+// ECE 4760 Final Project: batch spectrum analyzer
+//
+// Reduces any number of WAV recordings to the 32 bin spectrum sequences the
+// FFT MCU would send, using the spectrum engine on every core.
+//
+//   gcc -O2 -mavx2 -pthread -o specbatch specbatch.c spectrum.c spectrum_simd.c capture.c -lm
+//   specbatch [-j threads] [-f freqopt] [-s hop] [-b bits] [-a] [-d] [-c | -k] -o out files...
+//
+// Each recording is resampled to the firmware's 8 kHz sample rate and mapped
+// to the ADC's reading, 10 bits or with -b 8 the ADCH of the 8 bit build
+// (mid scale is the nominal 140 count, 8 bit, input bias). The DC is then
+// removed by fft.c's DC_BLOCK running mean, run over the whole recording
+// as if every sample were taken, or with -d by the constant 140 of the
+// DC_BLOCK 0 build. -b 9 and 11
+// give the decimated samples of the OVERSAMPLE builds, quantization only:
+// the box car over each sample period is not modelled. Frames
+// start every hop samples, N_WAVE by default. -a models fft.c's AGC build,
+// which adds each frame's gain shift to the output.
+// Output is CSV (-c: file,frame,bin0..bin31 or file,frame,gain,bin0..bin31)
+// or binary: for each input in command line order a 32 bit little endian
+// frame count and then the frames, SPEC_BINS bytes each (with -a preceded by
+// the gain byte). With -k every input gets its own capture file
+// (capture.h) named out0.spc, out1.spc, ... timed by frame start.
+//
+// Scheduling: a file is loaded by whichever worker takes it and then split
+// into chunks of frames pushed on that worker's deque. Workers take their
+// own newest chunk first and steal the oldest chunk of another worker when
+// they run dry, so a few long recordings still spread over all cores.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "spectrum.h"
+#include "capture.h"
+
+#define SAMPLE_RATE 8000	// 16 MHz / ADC_TIME
+#define ADC_OFFSET 140		// nominal input bias, in 8 bit counts
+#define DC_SHIFT 8			// fft.c's DC blocker time constant, 2^DC_SHIFT samples
+#define CHUNK 512			// frames per task
+#define MAX_THREADS 256
+
+typedef struct {
+	const char *name;
+	int16_t *adc;			// resampled, offset-removed samples
+	long nsamp;
+	long nframes;
+	uint8_t *bins;			// nframes*SPEC_BINS
+	uint8_t *gains;			// nframes gain shifts
+	atomic_int chunks;		// chunks still being worked on
+	int failed;
+} job;
+
+typedef struct {
+	int file;
+	long first;				// first frame, -1 to load the file
+	long count;
+} task;
+
+typedef struct {
+	pthread_mutex_t lock;
+	task *t;
+	int head, tail, size;	// steal at head, own work at tail
+} deque;
+
+static spec_tables tables;
+static job *jobs;
+static deque dq[MAX_THREADS];
+static int nthreads = 1;
+static int freqopt = 0;
+static long hop = SPEC_N_WAVE;
+static int dcblock = 1;
+static atomic_long pending;	// tasks queued or running
+
+static void dq_push(deque *d, task t) {
+	pthread_mutex_lock(&d->lock);
+	if (d->tail == d->size) {
+		// compact, then grow
+		memmove(d->t, d->t + d->head, (d->tail - d->head) * sizeof(task));
+		d->tail -= d->head;
+		d->head = 0;
+		if (d->tail == d->size) {
+			d->size = d->size ? d->size * 2 : 64;
+			d->t = realloc(d->t, d->size * sizeof(task));
+		}
+	}
+	d->t[d->tail++] = t;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static int dq_pop(deque *d, task *t, int steal) {
+	int ok = 0;
+	pthread_mutex_lock(&d->lock);
+	if (d->head < d->tail) {
+		*t = steal ? d->t[d->head++] : d->t[--d->tail];
+		ok = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return ok;
+}
+
+static uint32_t rd32(const uint8_t *p) { return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24; }
+static uint16_t rd16(const uint8_t *p) { return p[0] | p[1]<<8; }
+
+// Read a PCM WAV (8/16 bit, any channel count and rate) as the ADC would see it
+static int load_wav(job *jb) {
+	FILE *fp = fopen(jb->name, "rb");
+	uint8_t h[12], c[8], fmt[16];
+	uint8_t *data = NULL;
+	uint32_t len = 0, rate = 0;
+	int chans = 0, bits = 0, have_fmt = 0;
+
+	if (!fp) return -1;
+	if (fread(h, 1, 12, fp) != 12 || memcmp(h, "RIFF", 4) || memcmp(h + 8, "WAVE", 4)) goto bad;
+	while (fread(c, 1, 8, fp) == 8) {
+		len = rd32(c + 4);
+		if (!memcmp(c, "fmt ", 4) && len >= 16) {
+			if (fread(fmt, 1, 16, fp) != 16) goto bad;
+			if (rd16(fmt) != 1) goto bad;		// PCM only
+			chans = rd16(fmt + 2);
+			rate = rd32(fmt + 4);
+			bits = rd16(fmt + 14);
+			have_fmt = 1;
+			fseek(fp, (len - 16) + (len & 1), SEEK_CUR);
+		} else if (!memcmp(c, "data", 4) && have_fmt) {
+			data = malloc(len ? len : 1);
+			len = fread(data, 1, len, fp);
+			break;
+		} else fseek(fp, len + (len & 1), SEEK_CUR);
+	}
+	fclose(fp);
+	fp = NULL;
+	if (!data || chans < 1 || rate == 0 || (bits != 8 && bits != 16)) goto bad;
+
+	long in = len / (chans * (bits / 8));
+	jb->nsamp = (long)((double)in * SAMPLE_RATE / rate);
+	jb->adc = malloc((jb->nsamp ? jb->nsamp : 1) * sizeof(int16_t));
+	uint32_t dcacc = (uint32_t)(ADC_OFFSET << tables.adc_extra) << DC_SHIFT;	// adc_sample()'s
+	for (long i = 0; i < jb->nsamp; i++) {
+		// the ADC samples instantaneously: take the nearest earlier input
+		// sample, first channel, no anti-alias filter just like the hardware
+		long k = (long)((double)i * rate / SAMPLE_RATE);
+		int s = (bits == 16) ? (int16_t)rd16(data + k*chans*2) : (data[k*chans] - 128) << 8;
+		int v = (s >> (8 - tables.adc_extra)) + (ADC_OFFSET << tables.adc_extra);
+		if (v < 0) v = 0;
+		if (v > (256 << tables.adc_extra) - 1) v = (256 << tables.adc_extra) - 1;
+		if (dcblock) {
+			dcacc += v - (dcacc >> DC_SHIFT);
+			jb->adc[i] = v - (int)((dcacc + (1 << (DC_SHIFT-1))) >> DC_SHIFT);
+		} else jb->adc[i] = v - (ADC_OFFSET << tables.adc_extra);
+	}
+	free(data);
+	return 0;
+bad:
+	if (fp) fclose(fp);
+	free(data);
+	return -1;
+}
+
+static void run(int self, task t) {
+	job *jb = &jobs[t.file];
+
+	if (t.first < 0) {
+		if (load_wav(jb) < 0) {
+			fprintf(stderr, "specbatch: cannot read %s\n", jb->name);
+			jb->failed = 1;
+			return;
+		}
+		jb->nframes = jb->nsamp >= SPEC_N_WAVE ? (jb->nsamp - SPEC_N_WAVE) / hop + 1 : 0;
+		jb->bins = malloc(jb->nframes * SPEC_BINS + 1);
+		jb->gains = malloc(jb->nframes + 1);
+		long n = (jb->nframes + CHUNK - 1) / CHUNK;
+		if (n == 0) {
+			// shorter than one frame, no chunk will free the samples
+			free(jb->adc);
+			jb->adc = NULL;
+			return;
+		}
+		atomic_store(&jb->chunks, (int)n);
+		atomic_fetch_add(&pending, n);
+		for (long c = 0; c < n; c++) {
+			task s = {t.file, c * CHUNK, jb->nframes - c*CHUNK < CHUNK ? jb->nframes - c*CHUNK : CHUNK};
+			dq_push(&dq[self], s);
+		}
+		return;
+	}
+
+	if (hop == SPEC_N_WAVE)
+		spec_frames(&tables, jb->adc + t.first*SPEC_N_WAVE, t.count, freqopt, jb->bins + t.first*SPEC_BINS,
+			jb->gains + t.first);
+	else
+		for (long f = t.first; f < t.first + t.count; f++)
+			jb->gains[f] = spec_frame(&tables, jb->adc + f*hop, freqopt, jb->bins + f*SPEC_BINS);
+	if (atomic_fetch_sub(&jb->chunks, 1) == 1) {
+		free(jb->adc);
+		jb->adc = NULL;
+	}
+}
+
+static void *worker(void *arg) {
+	int self = (int)(intptr_t)arg;
+	task t;
+
+	while (atomic_load(&pending) > 0) {
+		int got = dq_pop(&dq[self], &t, 0);
+		for (int i = 1; !got && i < nthreads; i++)
+			got = dq_pop(&dq[(self + i) % nthreads], &t, 1);
+		if (!got) {
+			sched_yield();
+			continue;
+		}
+		run(self, t);
+		atomic_fetch_sub(&pending, 1);
+	}
+	return NULL;
+}
+
+static int write_captures(const char *prefix, int nfiles) {
+	char path[4096];
+	int err = 0;
+
+	for (int i = 0; i < nfiles; i++) {
+		job *jb = &jobs[i];
+		capture_writer *w;
+		snprintf(path, sizeof(path), "%s%d.spc", prefix, i);
+		if (!(w = capture_create(path, freqopt, SPEC_SHIFT - tables.adc_extra))) return -1;
+		for (long f = 0; !jb->failed && f < jb->nframes; f++)
+			err |= capture_write(w, (uint64_t)f * hop * 1000000 / SAMPLE_RATE, jb->gains[f],
+				(tables.agc ? SPEC_LINK_AGC : 0) | (dcblock ? SPEC_LINK_DC : 0), jb->bins + f*SPEC_BINS);
+		err |= capture_close(w);
+	}
+	return err;
+}
+
+static int write_out(const char *path, int nfiles, int csv) {
+	FILE *fp = fopen(path, csv ? "w" : "wb");
+	if (!fp) return -1;
+	for (int i = 0; i < nfiles; i++) {
+		job *jb = &jobs[i];
+		long n = jb->failed ? 0 : jb->nframes;
+		if (csv) {
+			for (long f = 0; f < n; f++) {
+				fprintf(fp, "%s,%ld", jb->name, f);
+				if (tables.agc) fprintf(fp, ",%d", jb->gains[f]);
+				for (int b = 0; b < SPEC_BINS; b++) fprintf(fp, ",%d", jb->bins[f*SPEC_BINS + b]);
+				fputc('\n', fp);
+			}
+		} else {
+			uint8_t c[4] = {n, n >> 8, n >> 16, n >> 24};
+			fwrite(c, 1, 4, fp);
+			if (!tables.agc) fwrite(jb->bins, SPEC_BINS, n, fp);
+			else for (long f = 0; f < n; f++) {
+				fputc(jb->gains[f], fp);
+				fwrite(jb->bins + f*SPEC_BINS, SPEC_BINS, 1, fp);
+			}
+		}
+	}
+	return fclose(fp);
+}
+
+int main(int argc, char **argv) {
+	const char *out = NULL;
+	int csv = 0, cap = 0, agc = 0, bits = 10, opt, nfiles, failed = 0;
+	pthread_t th[MAX_THREADS];
+
+	nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:f:s:b:adcko:")) != -1) {
+		switch (opt) {
+		case 'j': nthreads = atoi(optarg); break;
+		case 'f': freqopt = atoi(optarg) ? 1 : 0; break;
+		case 's': hop = atol(optarg); break;
+		case 'b': bits = atoi(optarg); break;
+		case 'a': agc = 1; break;
+		case 'd': dcblock = 0; break;
+		case 'c': csv = 1; break;
+		case 'k': cap = 1; break;
+		case 'o': out = optarg; break;
+		default: out = NULL; optind = argc + 1; break;
+		}
+	}
+	if (!out || optind >= argc || hop < 1 || bits < 8 || bits > 11) {
+		fprintf(stderr, "usage: specbatch [-j threads] [-f freqopt] [-s hop] [-b bits] [-a] [-d] [-c | -k] -o out files...\n");
+		return 2;
+	}
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+	spec_init(&tables, 6, 48, 188);
+	tables.agc = agc;
+	tables.adc_extra = bits - 8;
+	nfiles = argc - optind;
+	jobs = calloc(nfiles, sizeof(job));
+	for (int i = 0; i < nthreads; i++) pthread_mutex_init(&dq[i].lock, NULL);
+	// one load task per file, dealt round robin
+	atomic_store(&pending, nfiles);
+	for (int i = 0; i < nfiles; i++) {
+		task t = {i, -1, 0};
+		jobs[i].name = argv[optind + i];
+		dq_push(&dq[i % nthreads], t);
+	}
+	for (int i = 0; i < nthreads; i++) pthread_create(&th[i], NULL, worker, (void *)(intptr_t)i);
+	for (int i = 0; i < nthreads; i++) pthread_join(th[i], NULL);
+
+	for (int i = 0; i < nfiles; i++) failed |= jobs[i].failed;
+	if ((cap ? write_captures(out, nfiles) : write_out(out, nfiles, csv)) != 0) {
+		fprintf(stderr, "specbatch: cannot write %s\n", out);
+		return 1;
+	}
+	return failed;
+}
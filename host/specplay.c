@@ -0,0 +1,259 @@
+// ECE 4760 Final Project: capture replay
+//
+// Plays a capture (capture.h) through the display side of video.c: log
+// scale, RC decay and peak caps, drawn into the same 160x200 bar layout.
+//
+//   gcc -O2 -o specplay specplay.c spectrum.c spectrum_simd.c capture.c -lm
+//   specplay [-r] [-l] [-d decay] [-s seconds] [-n frames] [-i] [-p prefix] [-q] capture
+//   specplay -H replay.h [-s seconds] [-n frames] capture
+//
+// Frames are played as fast as possible unless -r paces them by their
+// capture timestamps. The screen is printed as a text bar chart, written
+// as PBM images (-p prefix gives prefix000000.pbm, ...) or skipped (-q,
+// to time the display code). -i reads commands from stdin instead:
+//   n / Enter  next frame        b  previous frame
+//   g <secs>   go to a time      l  log scale on/off
+//   d <1-3>    decay (F,M,S)     p  pause on/off      q  quit
+// Stepping back or seeking replays the display state from the first
+// frame, so every frame looks exactly as it did in a straight run.
+//
+// -H writes the frames as a flash table for the video MCU's REPLAY build
+// (see video.c), which feeds them into its receive ring in place of the
+// FFT MCU.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "spectrum.h"
+#include "capture.h"
+
+// video.c geometry in its default VIDEO_160 / FRAME_DOUBLE build
+#define SCREEN_W 160
+#define SCREEN_H 200
+#define BAR_PITCH (SCREEN_W/SPEC_BINS)
+#define BAR_WIDTH (BAR_PITCH-1)
+#define BAR_BOTTOM (SCREEN_H-1)
+#define BAR_MAX (BAR_BOTTOM-11)
+#define PEAK_HOLD 30
+#define PEAK_FALL 2
+#define MAX_FLASH_FRAMES 1500	// 54 KB, stays in the 64K pgm_read_byte() reaches
+
+static spec_tables tables;
+static capture cap;
+
+// display state, everything video.c keeps between frames
+typedef struct {
+	uint8_t oldhist[SPEC_BINS];
+	uint8_t height[SPEC_BINS];
+	uint8_t peak[SPEC_BINS], peakhold[SPEC_BINS];
+	int logopt, decayopt, runopt;
+	uint64_t next;			// next capture frame
+} display;
+
+static uint8_t screen[SCREEN_H][SCREEN_W];
+
+static void display_reset(display *d) {
+	int logopt = d->logopt, decayopt = d->decayopt;
+	memset(d, 0, sizeof(*d));
+	d->logopt = logopt;
+	d->decayopt = decayopt;
+	d->runopt = 1;
+}
+
+// one received frame, as the main loop of video.c handles it
+static void display_frame(display *d, const capture_frame *f) {
+	uint8_t hist[SPEC_BINS];
+
+	if (!d->runopt) return;		// paused frames are never drawn
+	memcpy(hist, f->bins, SPEC_BINS);
+	spec_display(&tables, hist, d->oldhist, d->logopt, d->decayopt, f->gain, f->flags, d->height);
+	for (int j = 0; j < SPEC_BINS; j++) {
+		uint8_t y = d->height[j];
+		if (y >= d->peak[j]) {d->peak[j] = y; d->peakhold[j] = PEAK_HOLD;}
+		else if (d->peakhold[j] > 0) d->peakhold[j]--;
+		else if (d->peak[j] > y + PEAK_FALL) d->peak[j] -= PEAK_FALL;
+		else d->peak[j] = y;
+	}
+}
+
+// replay from the start up to frame n, so any frame can be reached exactly
+static void display_goto(display *d, uint64_t n) {
+	int runopt = d->runopt;
+	if (n < d->next) display_reset(d);
+	d->runopt = 1;
+	while (d->next < n && d->next < cap.hdr->count) display_frame(d, capture_at(&cap, d->next++));
+	d->runopt = runopt;
+}
+
+static void render(const display *d) {
+	memset(screen, 0, sizeof(screen));
+	// borders and title line
+	for (int x = 0; x < SCREEN_W; x++) screen[0][x] = screen[10][x] = screen[SCREEN_H-1][x] = 1;
+	for (int y = 0; y < SCREEN_H; y++) screen[y][SCREEN_W-1] = 1;
+	for (int j = 0; j < SPEC_BINS; j++) {
+		int x0 = j*BAR_PITCH;
+		for (int y = BAR_BOTTOM - d->height[j]; y < BAR_BOTTOM; y++)
+			for (int x = x0; x < x0 + BAR_WIDTH; x++) screen[y][x] = 1;
+		if (d->peak[j] > 0) {
+			// the cap on the freshly erased frame, kept below the title line
+			int cap = (d->peak[j] < BAR_MAX) ? BAR_BOTTOM-1-d->peak[j] : BAR_BOTTOM-BAR_MAX;
+			for (int x = x0; x < x0 + BAR_WIDTH; x++) screen[cap][x] = 1;
+		}
+	}
+}
+
+static void print_text(const display *d) {
+	// 8 lines per text row, one column per bar
+	for (int r = BAR_MAX/8; r >= 0; r--) {
+		for (int j = 0; j < SPEC_BINS; j++) {
+			int h = d->height[j], p = d->peak[j];
+			putchar(h > r*8 ? '#' : (p > 0 && p/8 == r) ? '-' : ' ');
+		}
+		putchar('\n');
+	}
+	if (d->next == 0) printf("start");
+	else printf("frame %llu  t %.3f s", (unsigned long long)d->next - 1, capture_at(&cap, d->next - 1)->time / 1e6);
+	printf("  log %c  decay %c%s\n", d->logopt ? 'Y' : 'N', "?FMS"[d->decayopt], d->runopt ? "" : "  paused");
+}
+
+static int write_pbm(const char *prefix, uint64_t n) {
+	char path[4096];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s%06llu.pbm", prefix, (unsigned long long)n);
+	if (!(fp = fopen(path, "wb"))) return -1;
+	fprintf(fp, "P4\n%d %d\n", SCREEN_W, SCREEN_H);
+	for (int y = 0; y < SCREEN_H; y++)
+		for (int x = 0; x < SCREEN_W; x += 8) {
+			uint8_t b = 0;
+			for (int i = 0; i < 8; i++) b |= screen[y][x+i] << (7-i);
+			fputc(b, fp);
+		}
+	return fclose(fp);
+}
+
+static int write_flash(const char *path, uint64_t first, uint64_t n) {
+	FILE *fp = fopen(path, "w");
+	if (!fp) return -1;
+	fprintf(fp, "// replay frames for video.c REPLAY builds, written by specplay\r\n");
+	fprintf(fp, "#define REPLAY_FRAMES %llu\r\n", (unsigned long long)n);
+	fprintf(fp, "#define REPLAY_FREQOPT %d\r\n", cap.hdr->freqopt);
+	fprintf(fp, "prog_uchar replayFrames[REPLAY_FRAMES][LINK_FRAME] = {\r\n");
+	for (uint64_t i = 0; i < n; i++) {
+		const capture_frame *f = capture_at(&cap, first + i);
+		// link header: sync, gain, flags, frame count
+		fprintf(fp, "\t0xA5,%d,%d,%d, ", f->gain, f->flags, (int)(i & 0xff));
+		for (int b = 0; b < SPEC_BINS; b++) fprintf(fp, "%d,", f->bins[b]);
+		fprintf(fp, "\r\n");
+	}
+	fprintf(fp, "};\r\n");
+	return fclose(fp);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void interactive(display *d) {
+	char cmd[256];
+
+	render(d);
+	print_text(d);
+	while (fgets(cmd, sizeof(cmd), stdin)) {
+		switch (cmd[0]) {
+		case '\n': case 'n':
+			if (d->next < cap.hdr->count) display_frame(d, capture_at(&cap, d->next++));
+			break;
+		case 'b': display_goto(d, d->next > 1 ? d->next - 1 : 0); break;
+		case 'g': display_goto(d, capture_seek(&cap, (uint64_t)(atof(cmd + 1) * 1e6)) + 1); break;
+		case 'l': d->logopt = !d->logopt; break;
+		case 'd': if (atoi(cmd + 1) >= 1 && atoi(cmd + 1) <= 3) d->decayopt = atoi(cmd + 1); break;
+		case 'p': d->runopt = !d->runopt; break;
+		case 'q': return;
+		}
+		render(d);
+		print_text(d);
+	}
+}
+
+int main(int argc, char **argv) {
+	display d;
+	const char *prefix = NULL, *flash = NULL;
+	int opt, realtime = 0, quiet = 0, inter = 0;
+	double start = 0, t0;
+	long count = -1;
+	uint64_t first, last;
+
+	memset(&d, 0, sizeof(d));
+	d.decayopt = 2;		// medium, video.c's power up setting
+	while ((opt = getopt(argc, argv, "rld:s:n:ip:qH:")) != -1) {
+		switch (opt) {
+		case 'r': realtime = 1; break;
+		case 'l': d.logopt = 1; break;
+		case 'd': d.decayopt = atoi(optarg); break;
+		case 's': start = atof(optarg); break;
+		case 'n': count = atol(optarg); break;
+		case 'i': inter = 1; break;
+		case 'p': prefix = optarg; break;
+		case 'q': quiet = 1; break;
+		case 'H': flash = optarg; break;
+		default: optind = argc; break;
+		}
+	}
+	if (optind != argc - 1 || d.decayopt < 1 || d.decayopt > 3) {
+		fprintf(stderr, "usage: specplay [-r] [-l] [-d decay] [-s seconds] [-n frames] [-i] [-p prefix] [-q] capture\n"
+			"       specplay -H replay.h [-s seconds] [-n frames] capture\n");
+		return 2;
+	}
+	if (capture_open(&cap, argv[optind])) {
+		fprintf(stderr, "specplay: cannot read %s\n", argv[optind]);
+		return 1;
+	}
+	spec_init(&tables, 6, 48, BAR_MAX);
+	first = capture_seek(&cap, (uint64_t)(start * 1e6));
+	last = cap.hdr->count;
+	if (count >= 0 && first + count < last) last = first + count;
+
+	if (flash) {
+		if (last - first > MAX_FLASH_FRAMES) last = first + MAX_FLASH_FRAMES;
+		return write_flash(flash, first, last - first) ? 1 : 0;
+	}
+
+	display_reset(&d);
+	display_goto(&d, first);
+	if (inter) {
+		interactive(&d);
+		capture_unmap(&cap);
+		return 0;
+	}
+
+	t0 = now();
+	while (d.next < last) {
+		const capture_frame *f = capture_at(&cap, d.next);
+		if (realtime) {
+			double due = (f->time - capture_at(&cap, first)->time) / 1e6 - (now() - t0);
+			if (due > 0) usleep((useconds_t)(due * 1e6));
+		}
+		display_frame(&d, f);
+		d.next++;
+		if (quiet) continue;
+		render(&d);
+		if (prefix) {
+			if (write_pbm(prefix, d.next - 1)) {
+				fprintf(stderr, "specplay: cannot write %s frames\n", prefix);
+				return 1;
+			}
+		} else {
+			print_text(&d);
+		}
+	}
+	t0 = now() - t0;
+	fprintf(stderr, "%llu frames in %.3f s, %.0f frames/s\n", (unsigned long long)(last - first),
+		t0, t0 > 0 ? (last - first) / t0 : 0.0);
+	capture_unmap(&cap);
+	return 0;
+}
@@ -0,0 +1,184 @@
+// ECE 4760 Final Project: host spectrum engine, scalar reference
+//
+// Mirrors fft.c line for line with AVR integer widths: int is 16 bits and
+// wraps, char is unsigned 8 bits. See spectrum.h.
+
+#include <math.h>
+#include <string.h>
+#include "spectrum.h"
+
+// fft.c's multfix: 16x16 signed multiply, middle 16 bits of the product
+static inline int16_t multfix(int16_t a, int16_t b) {
+	return (int16_t)(((int32_t)a * b) >> 8);
+}
+
+void spec_init(spec_tables *t, int floor_db, int ceil_db, int height) {
+	int i;
+	volatile float f;	// keep every step in single precision like the AVR
+
+	for (i = 0; i < SPEC_N_WAVE; i++) {
+		// one cycle sine table, float2fix(sin(6.283*((float)i)/N_WAVE))
+		f = 6.283f * (float)i / SPEC_N_WAVE;
+		f = sinf(f) * 256.0f;
+		t->sinewave[i] = (int16_t)f;
+		// trapezoid mask with 1/4 length slopes
+		if (i < 32) f = (8 * (float)i / 255) * 256.0f;
+		else if (i <= 96) f = 256.0f;
+		else f = ((128 - (float)i) * 8 / 255) * 256.0f;
+		t->mask[i] = (int16_t)f;
+	}
+	// logTable, LOG_HT() in video.c
+	t->height = height;
+	t->agc = 0;
+	t->adc_extra = 0;
+	t->logtable[0] = 0;
+	for (i = 1; i < 256; i++) {
+		f = 20.0f * log10f((float)i);
+		if (f <= floor_db) t->logtable[i] = 0;
+		else if (f >= ceil_db) t->logtable[i] = height;
+		else t->logtable[i] = (uint8_t)((f - floor_db) * height / (ceil_db - floor_db) + 0.5f);
+	}
+	// logMant and LOG16_OCTAVE, in 1/16 lines
+	float scale = 16.0f * height / (SPEC_LOG16_CEIL_DB - SPEC_LOG16_FLOOR_DB);
+	for (i = 128; i < 256; i++) {
+		f = (20.0f * log10f((float)i) - SPEC_LOG16_FLOOR_DB) * scale + 256.5f;
+		t->logmant[i-128] = (int16_t)f - 256;
+	}
+	f = 20.0f * 0.30103f * scale + 0.5f;
+	t->log16_octave = (int16_t)f;
+}
+
+int spec_agc_shift(const spec_tables *t, const int16_t *adc) {
+	int peak = 0, s = SPEC_AGC_MAX - t->adc_extra;
+
+	for (int i = 0; i < SPEC_N_WAVE; i++) {
+		int x = adc[i] < 0 ? -adc[i] : adc[i];
+		if (x > peak) peak = x;
+	}
+	while (s > 0 && peak > (SPEC_AGC_PEAK >> s)) s--;
+	return s;
+}
+
+//Adapted from code by:
+//Tom Roberts 11/8/89 and Malcolm Slaney 12/15/94 malcolm@interval.com
+//by way of fft.c
+void spec_fft(const spec_tables *t, int16_t fr[], int16_t fi[], int m) {
+	int mr, nn, i, j, L, k, istep, n;
+	int16_t qr, qi, tr, ti, wr, wi;
+
+	mr = 0;
+	n = 1 << m;
+	nn = n - 1;
+
+	// decimation in time - re-order data (real input, fi is all zero)
+	for (m = 1; m <= nn; ++m) {
+		L = n;
+		do L >>= 1; while (mr + L > nn);
+		mr = (mr & (L - 1)) + L;
+		if (mr <= m) continue;
+		tr = fr[m];
+		fr[m] = fr[mr];
+		fr[mr] = tr;
+	}
+
+	L = 1;
+	k = SPEC_LOG2_N - 1;
+	while (L < n) {
+		istep = L << 1;
+		for (m = 0; m < L; ++m) {
+			j = m << k;
+			wr = t->sinewave[j + SPEC_N_WAVE/4];
+			wi = -t->sinewave[j];
+			wr >>= 1;
+			wi >>= 1;
+
+			for (i = m; i < n; i += istep) {
+				j = i + L;
+				tr = multfix(wr, fr[j]) - multfix(wi, fi[j]);
+				ti = multfix(wr, fi[j]) + multfix(wi, fr[j]);
+				qr = fr[i] >> 1;
+				qi = fi[i] >> 1;
+				fr[j] = qr - tr;
+				fi[j] = qi - ti;
+				fr[i] = qr + tr;
+				fi[i] = qi + ti;
+			}
+		}
+		--k;
+		L = istep;
+	}
+}
+
+int spec_frame(const spec_tables *t, const int16_t *adc, int freqopt, uint8_t *bins) {
+	int16_t fr[SPEC_N_WAVE], fi[SPEC_N_WAVE];
+	uint16_t m, m2;
+	int i, k, shift = t->agc ? spec_agc_shift(t, adc) : SPEC_SHIFT - t->adc_extra;
+
+	memset(bins, 0, SPEC_BINS);
+	memset(fi, 0, sizeof(fi));
+	// scale up and window with the trapezoid
+	for (i = 0; i < SPEC_N_WAVE; i++)
+		fr[i] = multfix((int16_t)(adc[i] << shift), t->mask[i]);
+	spec_fft(t, fr, fi, SPEC_LOG2_N);
+	// magnitude of the first half summed into 8 bit bins, specAdd() in fft.c
+	for (i = 0; i < SPEC_N_WAVE/2; i++) {
+		m = multfix(fr[i], fr[i]);
+		m2 = multfix(fi[i], fi[i]);
+		m += m2;
+		k = (freqopt == 0) ? i/2 : i;
+		if (k >= SPEC_BINS) continue;
+		if (t->agc) {
+			// saturate instead of wrapping
+			if (m < m2) m = 0xffff;
+			if (m > 255) m = 255;
+			m += bins[k];
+			bins[k] = (m > 255) ? 255 : m;
+		}
+		else bins[k] += (uint8_t)m;
+	}
+	return shift + t->adc_extra;
+}
+
+void spec_frames_scalar(const spec_tables *t, const int16_t *adc, int nframes, int freqopt,
+	uint8_t *bins, uint8_t *gains) {
+	for (int f = 0; f < nframes; f++) {
+		int g = spec_frame(t, adc + f*SPEC_N_WAVE, freqopt, bins + f*SPEC_BINS);
+		if (gains) gains[f] = g;
+	}
+}
+
+// video_log16() in video.c
+static uint8_t log16(const spec_tables *t, unsigned x, int octaves) {
+	int h = octaves * t->log16_octave;
+
+	if (x == 0) return 0;
+	while (x >= 256) {x >>= 1; h += t->log16_octave;}
+	while (x < 128) {x <<= 1; h -= t->log16_octave;}
+	h = (h + t->logmant[x-128]) >> 4;
+	if (h < 0) return 0;
+	if (h > t->height) return t->height;
+	return h;
+}
+
+// video_agc() in video.c
+static uint8_t agc(const spec_tables *t, uint8_t m, int gain, int logopt) {
+	int g = 2 * (gain - SPEC_SHIFT);
+	unsigned v;
+
+	if (logopt == 1) return log16(t, m, -g);
+	if (g >= 8) return 0;
+	if (g >= 0) return m >> g;
+	v = (unsigned)m << -g;
+	return (v > 255) ? 255 : v;
+}
+
+void spec_display(const spec_tables *t, uint8_t *hist, uint8_t *oldhist,
+	int logopt, int decayopt, int gain, int flags, uint8_t *heights) {
+	for (int j = (flags & SPEC_LINK_DC) ? 0 : 1; j < SPEC_BINS; j++) {
+		if (flags & SPEC_LINK_AGC) hist[j] = agc(t, hist[j], gain, logopt);
+		else if (logopt == 1) hist[j] = t->logtable[hist[j]];
+		if (hist[j] >= oldhist[j]) oldhist[j] = hist[j];
+		else oldhist[j] = oldhist[j] - (oldhist[j] >> decayopt);
+		if (heights) heights[j] = (oldhist[j] > t->height) ? t->height : oldhist[j];
+	}
+}
@@ -0,0 +1,80 @@
+// ECE 4760 Final Project: host spectrum engine
+//
+// Host (PC) port of the analyzer's fixed-point signal chain so recordings
+// can be reduced to exactly the spectra the hardware would show.
+// The scalar path is bit-exact with fft.c and the display side of video.c:
+// 16 bit wrapping integer math, multfix = (a*b)>>8, FFTfix, 8 bit bin sums.
+// spec_frames() runs many frames at once with AVX2 or NEON when the
+// compiler targets them and gives the same results as the scalar path.
+//
+// Build with the firmware's own compiler flags in mind: char is unsigned.
+//   gcc -O2 -mavx2 -c spectrum.c spectrum_simd.c     (x86-64)
+//   gcc -O2 -c spectrum.c spectrum_simd.c            (ARM64, NEON is implicit)
+
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <stdint.h>
+
+#define SPEC_N_WAVE 128		// FFT size, N_WAVE in fft.c
+#define SPEC_LOG2_N 7
+#define SPEC_BINS 32		// bins sent to the video MCU
+#define SPEC_SHIFT 4		// ADC sample pre-scale before windowing, unity gain
+#define SPEC_AGC_PEAK 4096	// AGC: largest sample after the shift
+#define SPEC_AGC_MAX 11		// AGC: largest shift
+#define SPEC_LINK_AGC 0x01	// link header flag: bins scaled by the gain shift
+#define SPEC_LINK_DC 0x02	// link header flag: DC filtered out, bin 0 is shown
+#define SPEC_LOG16_FLOOR_DB (-36)	// video.c's 16 bit log scale
+#define SPEC_LOG16_CEIL_DB 48
+
+// Tables the firmware builds at boot (FFT side) or compile time (video side)
+typedef struct {
+	int16_t sinewave[SPEC_N_WAVE];	// Sinewave[] in fft.c
+	int16_t mask[SPEC_N_WAVE];		// adcMask[], trapezoid window
+	uint8_t logtable[256];			// logTable[] in video.c
+	int16_t logmant[128];			// logMant[] in video.c
+	int16_t log16_octave;			// LOG16_OCTAVE
+	uint8_t height;					// tallest bar, bar_max in video.c
+	int agc;						// fft.c built with AGC
+	int adc_extra;					// ADC_EXTRA, ADC bits read beyond 8
+} spec_tables;
+
+// Build the tables. The log scale arguments are LOG_FLOOR_DB, LOG_CEIL_DB
+// and LOG_HEIGHT of video.c (6, 48 and 188 in its default FRAME_DOUBLE mode).
+// AGC starts off, set t->agc to model fft.c's default AGC build.
+// adc_extra starts at 0 (8 bit samples), set it to the build's ADC_EXTRA,
+// 2 for the default 10 bit build.
+void spec_init(spec_tables *t, int floor_db, int ceil_db, int height);
+
+// In place fixed point FFT of 2^m points, FFTfix() in fft.c
+void spec_fft(const spec_tables *t, int16_t fr[], int16_t fi[], int m);
+
+// One frame: SPEC_N_WAVE offset-removed ADC samples (adcbuff, 8+adc_extra
+// bits) to the SPEC_BINS bytes the FFT MCU transmits. freqopt 1 is the
+// 2 kHz range. Returns the gain shift sent in the link header, in 8 bit
+// sample units.
+int spec_frame(const spec_tables *t, const int16_t *adc, int freqopt, uint8_t *bins);
+
+// nframes consecutive frames of samples to nframes*SPEC_BINS bytes and
+// nframes gain shifts (gains may be NULL), vectorized across frames where
+// the target allows
+void spec_frames(const spec_tables *t, const int16_t *adc, int nframes, int freqopt,
+	uint8_t *bins, uint8_t *gains);
+
+// Video MCU side of one frame: gain compensation or log scale, RC decay
+// into oldhist and the clamped bar heights (bin 0 is only shown with
+// SPEC_LINK_DC, as in video.c). gain and flags are from the link header,
+// heights may be NULL.
+void spec_display(const spec_tables *t, uint8_t *hist, uint8_t *oldhist,
+	int logopt, int decayopt, int gain, int flags, uint8_t *heights);
+
+// Scalar reference for a block of frames, used by spec_frames for the
+// frames left over after the vector blocks
+void spec_frames_scalar(const spec_tables *t, const int16_t *adc, int nframes, int freqopt,
+	uint8_t *bins, uint8_t *gains);
+
+// Gain shift fft.c's AGC picks for a frame of samples, gainshift before
+// the link header adds adc_extra
+int spec_agc_shift(const spec_tables *t, const int16_t *adc);
+
+#endif
@@ -0,0 +1,160 @@
+// ECE 4760 Final Project: host spectrum engine, batched kernels
+//
+// Every frame runs the same FFT, so the frames of a block are laid out one
+// per vector lane (row i of the block holds sample i of LANES frames) and
+// each butterfly of FFTfix becomes one vector operation per row.
+// Results are bit-exact with spectrum.c: the vector multfix keeps bits
+// 8..23 of the 32 bit product and all adds wrap at 16 bits, except the
+// AGC build's magnitudes which saturate. Each lane's AGC shift is a
+// multiply by its power of two.
+
+#include <string.h>
+#include "spectrum.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LANES 16
+typedef __m256i vec;
+#define vload(p)		_mm256_loadu_si256((const __m256i *)(p))
+#define vstore(p,v)		_mm256_storeu_si256((__m256i *)(p), (v))
+#define vdup(x)			_mm256_set1_epi16(x)
+#define vadd(a,b)		_mm256_add_epi16(a, b)
+#define vsub(a,b)		_mm256_sub_epi16(a, b)
+#define vsra1(a)		_mm256_srai_epi16(a, 1)
+#define vmul(a,b)		_mm256_mullo_epi16(a, b)
+#define vaddsu(a,b)		_mm256_adds_epu16(a, b)
+#define vmin255(a)		_mm256_min_epu16(a, _mm256_set1_epi16(255))
+// high half shifted up, low half shifted down: (a*b)>>8 in 16 bits
+static inline vec vmultfix(vec a, vec b) {
+	return _mm256_or_si256(_mm256_slli_epi16(_mm256_mulhi_epi16(a, b), 8),
+		_mm256_srli_epi16(_mm256_mullo_epi16(a, b), 8));
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LANES 8
+typedef int16x8_t vec;
+#define vload(p)		vld1q_s16(p)
+#define vstore(p,v)		vst1q_s16((p), (v))
+#define vdup(x)			vdupq_n_s16(x)
+#define vadd(a,b)		vaddq_s16(a, b)
+#define vsub(a,b)		vsubq_s16(a, b)
+#define vsra1(a)		vshrq_n_s16(a, 1)
+#define vmul(a,b)		vmulq_s16(a, b)
+#define vaddsu(a,b)		vreinterpretq_s16_u16(vqaddq_u16(vreinterpretq_u16_s16(a), vreinterpretq_u16_s16(b)))
+#define vmin255(a)		vreinterpretq_s16_u16(vminq_u16(vreinterpretq_u16_s16(a), vdupq_n_u16(255)))
+// widen, shift and narrow (keeps the low 16 bits like the AVR)
+static inline vec vmultfix(vec a, vec b) {
+	return vcombine_s16(vshrn_n_s32(vmull_s16(vget_low_s16(a), vget_low_s16(b)), 8),
+		vshrn_n_s32(vmull_s16(vget_high_s16(a), vget_high_s16(b)), 8));
+}
+#endif
+
+#ifdef LANES
+
+// FFTfix on LANES frames at once, fr and fi are [SPEC_N_WAVE][LANES]
+static void fft_block(const spec_tables *t, int16_t (*fr)[LANES], int16_t (*fi)[LANES]) {
+	int mr = 0, nn = SPEC_N_WAVE - 1, i, j, L, k, istep, m;
+	vec qr, qi, tr, ti, wr, wi, xr, xi;
+
+	// same bit reversal for every lane, swap whole rows
+	for (m = 1; m <= nn; ++m) {
+		L = SPEC_N_WAVE;
+		do L >>= 1; while (mr + L > nn);
+		mr = (mr & (L - 1)) + L;
+		if (mr <= m) continue;
+		tr = vload(fr[m]);
+		vstore(fr[m], vload(fr[mr]));
+		vstore(fr[mr], tr);
+	}
+
+	L = 1;
+	k = SPEC_LOG2_N - 1;
+	while (L < SPEC_N_WAVE) {
+		istep = L << 1;
+		for (m = 0; m < L; ++m) {
+			j = m << k;
+			wr = vdup(t->sinewave[j + SPEC_N_WAVE/4] >> 1);
+			wi = vdup((int16_t)(-t->sinewave[j]) >> 1);
+			for (i = m; i < SPEC_N_WAVE; i += istep) {
+				j = i + L;
+				xr = vload(fr[j]);
+				xi = vload(fi[j]);
+				tr = vsub(vmultfix(wr, xr), vmultfix(wi, xi));
+				ti = vadd(vmultfix(wr, xi), vmultfix(wi, xr));
+				qr = vsra1(vload(fr[i]));
+				qi = vsra1(vload(fi[i]));
+				vstore(fr[j], vsub(qr, tr));
+				vstore(fi[j], vsub(qi, ti));
+				vstore(fr[i], vadd(qr, tr));
+				vstore(fi[i], vadd(qi, ti));
+			}
+		}
+		--k;
+		L = istep;
+	}
+}
+
+// magnitude of FFT point i in every lane, saturated to a byte for AGC
+static inline vec vmag(int16_t (*fr)[LANES], int16_t (*fi)[LANES], int i, int agc) {
+	vec r = vload(fr[i]), m = vload(fi[i]);
+	if (agc) return vmin255(vaddsu(vmultfix(r, r), vmultfix(m, m)));
+	return vadd(vmultfix(r, r), vmultfix(m, m));
+}
+
+static void frames_block(const spec_tables *t, const int16_t *adc, int freqopt, uint8_t *bins, uint8_t *gains) {
+	int16_t fr[SPEC_N_WAVE][LANES], fi[SPEC_N_WAVE][LANES], mag[SPEC_N_WAVE/2][LANES];
+	int16_t gain[LANES];
+	int i, l;
+
+	// transpose the frames into lanes
+	for (l = 0; l < LANES; l++) {
+		int s = t->agc ? spec_agc_shift(t, adc + l*SPEC_N_WAVE) : SPEC_SHIFT - t->adc_extra;
+		gain[l] = 1 << s;
+		if (gains) gains[l] = s + t->adc_extra;
+		for (i = 0; i < SPEC_N_WAVE; i++)
+			fr[i][l] = adc[l*SPEC_N_WAVE + i];
+	}
+	memset(fi, 0, sizeof(fi));
+	for (i = 0; i < SPEC_N_WAVE; i++)
+		vstore(fr[i], vmultfix(vmul(vload(fr[i]), vload(gain)), vdup(t->mask[i])));
+	fft_block(t, fr, fi);
+
+	if (t->agc) {
+		for (i = 0; i < SPEC_BINS; i++)
+			vstore(mag[i], freqopt == 0 ? vmin255(vaddsu(vmag(fr, fi, 2*i, 1), vmag(fr, fi, 2*i+1, 1)))
+				: vmag(fr, fi, i, 1));
+	} else if (freqopt == 0) {
+		// pairs of bins summed, low bytes are what the 8 bit adds keep
+		for (i = 0; i < SPEC_N_WAVE/2; i += 2) {
+			vec a = vadd(vmultfix(vload(fr[i]), vload(fr[i])), vmultfix(vload(fi[i]), vload(fi[i])));
+			vec b = vadd(vmultfix(vload(fr[i+1]), vload(fr[i+1])), vmultfix(vload(fi[i+1]), vload(fi[i+1])));
+			vstore(mag[i/2], vadd(a, b));
+		}
+	} else {
+		for (i = 0; i < SPEC_BINS; i++)
+			vstore(mag[i], vadd(vmultfix(vload(fr[i]), vload(fr[i])), vmultfix(vload(fi[i]), vload(fi[i]))));
+	}
+	for (l = 0; l < LANES; l++)
+		for (i = 0; i < SPEC_BINS; i++)
+			bins[l*SPEC_BINS + i] = (uint8_t)mag[i][l];
+}
+
+void spec_frames(const spec_tables *t, const int16_t *adc, int nframes, int freqopt,
+	uint8_t *bins, uint8_t *gains) {
+	int f = 0;
+
+	for (; f + LANES <= nframes; f += LANES)
+		frames_block(t, adc + f*SPEC_N_WAVE, freqopt, bins + f*SPEC_BINS, gains ? gains + f : NULL);
+	spec_frames_scalar(t, adc + f*SPEC_N_WAVE, nframes - f, freqopt, bins + f*SPEC_BINS,
+		gains ? gains + f : NULL);
+}
+
+#else
+
+// no vector unit targeted, the reference is the whole engine
+void spec_frames(const spec_tables *t, const int16_t *adc, int nframes, int freqopt,
+	uint8_t *bins, uint8_t *gains) {
+	spec_frames_scalar(t, adc, nframes, freqopt, bins, gains);
+}
+
+#endif
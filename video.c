@@ -11,11 +11,10 @@
 #include <avr/interrupt.h>
 #include <stdlib.h> 
 #include <stdio.h>
-#include <math.h> 
 #define F_CPU 16000000UL
 #include <util/delay.h>  
 #include <avr/sleep.h>
-#include <math.h>
+#include "buttons.h"
 
 
 // optional, if preferred///
@@ -28,13 +27,30 @@
 //which is nice for keeping a realtime clock video timing
 #define LINE_TIME 1018
 #define SLEEP_TIME 999
+
+//Video modes, select one with VIDEO_MODE, the screen geometry follows
+//VIDEO_160: 160 pixels per line, USART0 shifts at 4 MHz
+//VIDEO_256: 256 pixels per line, USART0 shifts at 8 MHz
+#define VIDEO_160 0
+#define VIDEO_256 1
+#define VIDEO_MODE VIDEO_160
+#if VIDEO_MODE == VIDEO_256
+#define bytes_per_line 32
+#define video_ubrr 0		// MSPIM clock = 16MHz/(2*(UBRR0+1))
+#define line_delay 11		// us from sync end to the first pixel
+#else
 #define bytes_per_line 20
+#define video_ubrr 1
+#define line_delay 7
+#endif
+#define byte_cycles (16*(video_ubrr+1))	// cycles to shift out one byte
 #define screen_width (bytes_per_line*8)
 #define screen_height 200
 #define screen_array_size screen_width*screen_height/8
 
 #define ScreenTop 30
 #define ScreenBot (ScreenTop+screen_height)
+#define TextBot 62		// first screen line below the option text
 
 //current line number in the current frame
 volatile int LineCount;
@@ -42,45 +58,260 @@ volatile int LineCount;
 //sync
 char syncON, syncOFF;
 
-//160h x 160v - screen buffer and pointer
+//Framebuffer modes, select one with FRAME_MODE
+//FRAME_SINGLE: bars are erased and redrawn in the buffer being displayed
+//FRAME_DOUBLE: bars are drawn into a back buffer which the raster ISR
+//  swaps in during vertical blanking (needs 3 x 4000 bytes)
+//FRAME_BARLIST: one buffer and no erase buffer, only the part of each
+//  bar that changed since the last frame is redrawn during vertical blanking
+//FRAME_RACE: no bar framebuffer at all, the raster ISR builds each bar line
+//  from the bar heights as it is scanned out, only the text is in screen[]
+//FRAME_WATERFALL: scrolling spectrogram instead of bars, each frame becomes
+//  one dithered row and the raster ISR scrolls by rotating the row order
+#define FRAME_SINGLE 0
+#define FRAME_DOUBLE 1
+#define FRAME_BARLIST 2
+#define FRAME_RACE 3
+#define FRAME_WATERFALL 4
+#define FRAME_MODE FRAME_DOUBLE
+#if FRAME_MODE == FRAME_DOUBLE && VIDEO_MODE == VIDEO_256
+#error "3 x 6400 byte screens do not fit in SRAM, use FRAME_SINGLE or FRAME_BARLIST"
+#endif
+
+//160h (or 256h) x 200v - screen buffer and pointer
+//screen is drawn by main, screenindex is scanned out by the raster ISR
+#if FRAME_MODE == FRAME_DOUBLE
+char screenbuf[2][screen_array_size];
+char* screen = screenbuf[0];
+char* screenindex = screenbuf[1];
+volatile char swapreq;		// back buffer finished, swap at next blank line
+#elif FRAME_MODE == FRAME_RACE
+char screen[bytes_per_line*TextBot];	// text lines only, bar lines are generated
+char* screenindex = screen;
+volatile char swapreq;		// back bar lists finished, swap at next blank line
+#else
 char screen[screen_array_size];
 char* screenindex = screen;
+#endif
+#if FRAME_MODE == FRAME_SINGLE || FRAME_MODE == FRAME_DOUBLE
 char erasescreen[screen_array_size];
+#endif
 
 //One bit masks
 char pos[8] = {0x80,0x40,0x20,0x10,0x08,0x04,0x02,0x01};
 // Display variables
-#define width screen_width-1
-#define height screen_height-1
+#define width (screen_width-1)
+#define height (screen_height-1)
 #define bins 32
+#define bar_pitch (screen_width/bins)	// 5 pixels at 160, 8 at 256
+#define bar_width (bar_pitch-1)
+#define bar_bottom height			// bars end just above the bottom border
+#if FRAME_MODE == FRAME_BARLIST || FRAME_MODE == FRAME_RACE || FRAME_MODE == FRAME_WATERFALL
+#define bar_max (bar_bottom-TextBot)	// bars are never drawn over the text
+#else
+#define bar_max (bar_bottom-11)		// tallest bar that stays below the title line
+#endif
 int xpos, ypos;
+unsigned char barbyte[bins];		// byte offset of each bar within a line
+unsigned char barmask[bins][2];		// pixel masks of each bar in its two bytes
+#if FRAME_MODE == FRAME_BARLIST
+unsigned char barlist[bins];		// bar heights currently on the screen
+#define BARLIST_LINES 48			// blank lines left for a redraw to start, of 62
+#endif
+
+//Peak hold caps, a one line mark above each bar at its recent maximum
+//(not available in FRAME_RACE and FRAME_WATERFALL)
+#define PEAK_HOLD 30		// frames a peak is held before it falls, 0 for no caps
+#define PEAK_FALL 2			// lines a peak falls per frame after the hold
+#if FRAME_MODE == FRAME_RACE || FRAME_MODE == FRAME_WATERFALL
+#undef PEAK_HOLD
+#define PEAK_HOLD 0
+#endif
+#if PEAK_HOLD
+unsigned char peak[bins];			// held peak height of each bar
+unsigned char peakhold[bins];		// frames left to hold the peak
+unsigned char capline[bins];		// line of the cap on the screen, 0 for none
+#endif
+#if FRAME_MODE == FRAME_RACE
+//Bars are kept as one linked list per line holding the bars whose top is on
+//that line. The raster ISR ORs each list into the running line buffer, so a
+//bar line costs only the bars that start on it. Main builds the back lists.
+#define RACE_END 0xff					// end of a bar list
+#define RACE_BARS 8						// most bars added per line, the rest wait a line
+unsigned char racehead[2][bar_max+1];	// first bar starting on each bar line
+unsigned char racenext[2][bins];		// next bar starting on the same line
+volatile char racefront;				// list set being scanned out
+char raceback;							// list set being built by main
+char linebuf[bytes_per_line+1];			// pixels of the next bar line (+1 for the last bar's mask)
+unsigned char racerow, racepend;		// list being added and next bar in it
+#endif
+#if FRAME_MODE == FRAME_WATERFALL
+//The bar area holds WF_ROWS+1 rows used as a ring. The raster ISR shows
+//WF_ROWS of them starting at the newest row wftop, main writes the next
+//frame into the spare row and then moves wftop onto it.
+#define WF_ROWS (bar_max-1)		// rows on screen, one more is kept spare
+volatile char swapreq;			// new row finished, scroll at next blank line
+volatile unsigned char wftop;	// ring row shown on the first waterfall line
+unsigned char wfnext;			// ring row being drawn by main
+#endif
+//4x4 ordered (Bayer) dither thresholds and the byte masks built from them:
+//dithermask[level][y&3] holds the pixels of a byte lit at brightness
+//level 0-16 on lines y, so shaded areas are filled a byte at a time
+char dither[4][4] = {{0,8,2,10},{12,4,14,6},{3,11,1,9},{15,7,13,5}};
+char dithermask[17][4];
 volatile unsigned char hist[bins];	// array to hold frequency bins histogram
 unsigned char oldhist[bins];		// array to hold previous frame's bins
-volatile unsigned char currbin;		// freq bin array index
-char logTable[256];					// static natural logarithm table for magnitude
+volatile unsigned char currbin;		// byte of the link frame being received
+
+//Link frames start with a header packet: LINK_SYNC, the FFT MCU's gain
+//shift, flags and a frame count. The bins follow in 8 packets.
+#define LINK_HEADER 4
+#define LINK_FRAME (LINK_HEADER+bins)
+#define LINK_SYNC 0xA5
+#define LINK_GAIN_REF 4		// FFT input shift of unity gain
+#define LINK_AGC 0x01		// flag: bins were scaled by the gain shift
+#define LINK_DC 0x02		// flag: DC is filtered out, bin 0 is real signal
+#define LINK_IDLE 0x04		// flag: FFT MCU paused, no bins follow
+#define LINK_TRIG 0x08		// flag: frame of a trigger burst, linkhdr[3] is its index
+#define LINK_LAST 0x10		// flag: last frame of the burst
+unsigned char linkhdr[LINK_HEADER];
+unsigned char firstbin;		// first bin drawn, bin 0 is only DC without LINK_DC
+
+//Commands to the FFT MCU. USART1's transmitter sends them on TXD1 (wired to
+//the FFT MCU's RXD0), shifted out by the link clock while the FFT MCU sends,
+//so they only move while it transmits. One byte each: the opcode in the
+//high nibble, the argument in the low one. The FFT MCU applies them between
+//frames. bootConfig is sent at power up, edit it to set up a unit.
+#define CMD_SPAN 0x10		// 0 4 kHz, 1 2 kHz
+#define CMD_WINDOW 0x20		// 0 trapezoid, 1 rectangular, 2 Hann
+#define CMD_AVERAGE 0x30	// send the mean of 2^n frames, n up to 3
+#define CMD_BINS 0x40		// compute only the lowest 4n bins, 0 all
+#define CMD_PAUSE 0x50		// 1 stop computing and sending, 0 run
+#define CMD_TRIGGER 0x60	// arm the trigger: 0 off, 1 sample level, 2 band energy
+#define CMD_TRIGLEVEL 0x70	// trigger at a sample of (n+1)*8, or a band sum of (n+1)*16
+#define CMD_TRIGBAND 0x80	// the band is bins 2n and 2n+1
+#define TRIG_MODE 0			// CMD_TRIGGER at power up and after each burst, needs TRIGGER in fft.c
+#define TRIG_LEVEL 7
+#define TRIG_BAND 2
+#define TX_SIZE 16				// ring size, a power of 2
+#define TX_MASK (TX_SIZE-1)
+unsigned char txring[TX_SIZE];
+volatile unsigned char txhead;	// next command queued
+volatile unsigned char txtail;	// next command into UDR1
+const unsigned char bootConfig[] = {CMD_SPAN|1, CMD_WINDOW|0, CMD_AVERAGE|0, CMD_BINS|0,
+	CMD_TRIGLEVEL|TRIG_LEVEL, CMD_TRIGBAND|TRIG_BAND, CMD_TRIGGER|TRIG_MODE};
+
+//Trigger bursts. The FFT MCU sends the frames from around a trigger flagged
+//LINK_TRIG. They are kept here and after the last one shown in turn, a new
+//one every HOLD_STEP fields, in place of the live frames, until the run
+//button lets go of them and arms the trigger again.
+#define BURST_MAX 8				// at least TRIG_BLOCKS in fft.c
+#define HOLD_STEP 15			// video fields each burst frame is shown
+unsigned char burst[BURST_MAX][LINK_FRAME];
+unsigned char burstn;			// frames kept
+unsigned char burstshow;		// next frame shown
+char bursthold;					// showing the burst
+volatile unsigned char fieldtick;	// video fields since the last one was shown
+
+//Receive ring for the FFT MCU link. The USART1 receive interrupt fills it
+//during blank lines only, main moves the bytes into hist.
+#define RX_SIZE 64				// ring size, a power of 2
+#define RX_MASK (RX_SIZE-1)
+#define RX_CUTOFF 450			// TCNT1 in a line where Rx Ready is dropped again
+volatile unsigned char rxring[RX_SIZE];
+volatile unsigned char rxhead;	// next byte written by the receive ISR
+volatile unsigned char rxtail;	// next byte read by main
+unsigned char rxpkt;			// bytes received, every 4th ends a packet
+
+//Replay build. Set REPLAY to 1 to show recorded frames from flash instead of
+//the FFT MCU: the sync ISR stands in for the link and puts a packet into the
+//receive ring on blank lines, so main and the display path run unchanged.
+//Write the table from a capture with  specplay -H replay.h  (host/).
+//REPLAY_PACE is video frames per replayed frame, 0 is as fast as main draws.
+//The replayed frames drawn per second are shown on screen.
+#define REPLAY 0
+#define REPLAY_PACE 0
+#if REPLAY
+#include "replay.h"
+#if REPLAY_FRAMES > 1500
+#error "pgm_read_byte() only reaches the low 64K of flash, replay at most 1500 frames"
+#endif
+unsigned int replayframe;			// frame being sent
+unsigned char replaybyte;			// its next byte
+volatile unsigned char replaytick;	// video frames since it was started
+volatile unsigned char replayfields;	// video frames for the rate count
+unsigned char replaydrawn;			// frames drawn in that time
+char replayval[8];
+#endif
+
+//Raster timing profiler. Set PROFILE_RASTER to 1 to count, for every line,
+//how late the sync ISR started and how long it ran, and to total the
+//cycles left to main before the next sleep. The results are plain globals
+//so they can be read out of a simulator (e.g. simavr with avr-gdb:
+//  x/16wu &proflat) and are also printed on screen.
+#define PROFILE_RASTER 0
+#if PROFILE_RASTER
+volatile unsigned long proflat[16];	// sync ISR start latency, 1 cycle buckets
+volatile unsigned long profdur[32];	// sync ISR run time, 32 cycle buckets
+long profacc;						// main cycles so far in this frame
+volatile long proffree;				// main cycles in the last frame
+volatile long proffreemin;			// fewest main cycles in any frame
+char profval[8];
+#endif
+
+//Log amplitude scale, computed by the compiler into flash.
+//A magnitude at LOG_FLOOR_DB (20log10, magnitude 1 = 0 dB) or below is an
+//empty bar and one at LOG_CEIL_DB or above is LOG_HEIGHT lines tall.
+//16 bit magnitudes use their own floor and ceiling: they are shifted into
+//128-255, looked up in logMant and LOG16_OCTAVE is added per shift.
+//The floor is low enough for the quietest input the FFT MCU's AGC lifts
+//(7 shifts above unity, 84 dB) and the ceiling matches the 8 bit scale.
+#define LOG_FLOOR_DB 6
+#define LOG_CEIL_DB 48		// 255 is 48.1 dB
+#define LOG16_FLOOR_DB (-36)
+#define LOG16_CEIL_DB 48
+#define LOG_HEIGHT bar_max
+#define LOG_DB(i) (20.0*__builtin_log10((double)(i)))
+#define LOG_HT(i) ((i) == 0 || LOG_DB(i) <= LOG_FLOOR_DB ? 0 : \
+	LOG_DB(i) >= LOG_CEIL_DB ? LOG_HEIGHT : \
+	(unsigned char)((LOG_DB(i) - LOG_FLOOR_DB) * LOG_HEIGHT / (LOG_CEIL_DB - LOG_FLOOR_DB) + 0.5))
+#define LOG16_SCALE (16.0 * LOG_HEIGHT / (LOG16_CEIL_DB - LOG16_FLOOR_DB))	// 1/16 lines per dB
+#define LOG16_MANT(i) ((int)((LOG_DB(i) - LOG16_FLOOR_DB) * LOG16_SCALE + 256.5) - 256)
+#define LOG16_OCTAVE ((int)(20.0 * 0.30103 * LOG16_SCALE + 0.5))
+#define LOG_ROW16(f,i) f(i),f(i+1),f(i+2),f(i+3),f(i+4),f(i+5),f(i+6),f(i+7), \
+	f(i+8),f(i+9),f(i+10),f(i+11),f(i+12),f(i+13),f(i+14),f(i+15)
+//bar height of 8 bit magnitudes
+prog_uchar logTable[256] = {
+	LOG_ROW16(LOG_HT,0), LOG_ROW16(LOG_HT,16), LOG_ROW16(LOG_HT,32), LOG_ROW16(LOG_HT,48),
+	LOG_ROW16(LOG_HT,64), LOG_ROW16(LOG_HT,80), LOG_ROW16(LOG_HT,96), LOG_ROW16(LOG_HT,112),
+	LOG_ROW16(LOG_HT,128), LOG_ROW16(LOG_HT,144), LOG_ROW16(LOG_HT,160), LOG_ROW16(LOG_HT,176),
+	LOG_ROW16(LOG_HT,192), LOG_ROW16(LOG_HT,208), LOG_ROW16(LOG_HT,224), LOG_ROW16(LOG_HT,240)
+};
+//unclamped bar height*16 of 16 bit magnitude mantissas 128-255
+prog_int16_t logMant[128] = {
+	LOG_ROW16(LOG16_MANT,128), LOG_ROW16(LOG16_MANT,144), LOG_ROW16(LOG16_MANT,160), LOG_ROW16(LOG16_MANT,176),
+	LOG_ROW16(LOG16_MANT,192), LOG_ROW16(LOG16_MANT,208), LOG_ROW16(LOG16_MANT,224), LOG_ROW16(LOG16_MANT,240)
+};
 
 // User options
-char runopt;	// pause or not
+volatile char runopt;	// pause or not
 char logopt;	// log or linear scale
 char decayopt;	// decay speed
 
-// State Machine Variables
-#define Release 0
-#define Debounce 1
-#define Pressed 2
-#define DebounceRel 3
-#define Toggle 4
-
-// FSM State variables
-unsigned char runState;
-unsigned char logState;
-unsigned char decayState;
-unsigned char buttons;	// stores PORTC values for FSM updates
-
-//function declarations
-void runStopFSM(void);
-void logScaleFSM(void);
-void decayFSM(void);
+//function declarations
+void cmd_send(unsigned char c);
+void runToggle(void);
+void logToggle(void);
+void decayToggle(void);
+
+// Buttons, scanned once a field by the sync ISR
+#define BUTTON_MASK 0x07
+const button_t videoButtons[] = {
+	{1<<2, runToggle},
+	{1<<1, logToggle},
+	{1<<0, decayToggle},
+};
+#define BUTTONS (sizeof(videoButtons)/sizeof(videoButtons[0]))
 
 // Static Messages to be Printed
 char cu1[]="Audio Spectrum Visualizer";
@@ -89,12 +320,13 @@ char runmsg[]="Paused=";
 char freqmsg[]="FreqRng=  kHz";
 char binmsg[]="BinRes=    Hz";
 char decaymsg[]="Decay =";
-// String variables to store user option display value
-char runval[2];
-char logval[2];
-char decayval[2];
-char freqval[2];
-char binval[5];
+// User option display values, set by the option handlers
+char* runval;
+char* logval;
+char* decayval;
+char* freqval;
+char* binval;
+char* decaylabel[4] = {"", "F", "M", "S"};	// by decayopt
 
 //================================ 
 //3x5 font numbers, then letters
@@ -1369,6 +1601,13 @@ prog_char ascii[128][7] = {
 	0b00000000
 };
 
+// drop Rx Ready at RX_CUTOFF, set up by rx_ready()
+ISR(TIMER2_COMPA_vect)
+{
+	PORTD &= ~(1<<PORTD7);
+	TIMSK2 = 0;
+}
+
 // put the MCU to sleep JUST before the CompA ISR goes off
 ISR(TIMER1_COMPB_vect, ISR_NAKED)
 {
@@ -1377,15 +1616,155 @@ ISR(TIMER1_COMPB_vect, ISR_NAKED)
 	reti();
 }
 
+//==================================
+//Unrolled line output. Each byte waits out the byte ahead of it in the
+//USART and then takes exactly 4 cycles (ld, sts), so the bytes go out
+//back to back without polling UDRE0.
+#define LINE_BYTE \
+	__builtin_avr_delay_cycles(byte_cycles - 4); \
+	__asm__ __volatile__ ( \
+	"ld __tmp_reg__, %a0+ \n\t" \
+	"sts %1, __tmp_reg__ \n\t" \
+	: "+e" (line) \
+	: "n" (_SFR_MEM_ADDR(UDR0)) \
+	);
+#define LINE_BYTES4 LINE_BYTE LINE_BYTE LINE_BYTE LINE_BYTE
+#define LINE_BYTES16 LINE_BYTES4 LINE_BYTES4 LINE_BYTES4 LINE_BYTES4
+//bytes after the first two
+#if VIDEO_MODE == VIDEO_256
+#define LINE_REST LINE_BYTES16 LINE_BYTES4 LINE_BYTES4 LINE_BYTES4 LINE_BYTE LINE_BYTE
+#else
+#define LINE_REST LINE_BYTES16 LINE_BYTE LINE_BYTE
+#endif
+
+#if FRAME_MODE == FRAME_RACE
+//==================================
+//build screen line y of the bar area into linebuf
+//called by the raster ISR right after the line before it is sent
+static inline void race_line(unsigned char y) {
+	unsigned char b, n;
+	unsigned char* head = racehead[racefront];
+	unsigned char* next = racenext[racefront];
+
+	if (y < TextBot || y > bar_bottom) return;
+	if (y == TextBot) {
+		//first bar line starts out with just the right border
+		for (b = 0; b < bytes_per_line-1; b++) linebuf[b] = 0;
+		linebuf[bytes_per_line-1] = 0x01;
+		racerow = TextBot;
+		racepend = head[0];
+	}
+	else if (y == bar_bottom) {
+		//bottom border
+		for (b = 0; b < bytes_per_line; b++) linebuf[b] = 0xff;
+		return;
+	}
+	//bars only get added going down, so OR in every bar whose top is on
+	//a line up to y, but no more than RACE_BARS of them per line
+	n = RACE_BARS;
+	while (racerow <= y) {
+		while (racepend != RACE_END) {
+			if (n-- == 0) return;
+			b = racepend;
+			linebuf[barbyte[b]] |= barmask[b][0];
+			linebuf[barbyte[b]+1] |= barmask[b][1];
+			racepend = next[b];
+		}
+		racerow++;
+		racepend = head[racerow - TextBot];
+	}
+}
+#endif
+
+#if FRAME_MODE == FRAME_BARLIST
+//==================================
+//blank lines left before the raster ISR reaches ScreenTop, 0 or less on the screen
+static inline int blank_left(void) {
+	int l;
+
+	do l = LineCount; while (l != LineCount);	// main reads it in two bytes
+	return (l >= ScreenBot) ? 262-l+ScreenTop : ScreenTop-l;
+}
+#endif
+
+#if PROFILE_RASTER
+//==================================
+//count one line of the profile, t0 is TCNT1 at sync ISR entry,
+//which is the number of cycles since the line started
+static inline void prof_line(unsigned int t0) {
+	unsigned int t1 = TCNT1, d = (t1 - t0) >> 5;
+
+	proflat[(t0 < 15) ? t0 : 15]++;
+	profdur[(d < 31) ? d : 31]++;	// the last bucket holds every overrun
+	//main runs from here until the sleep ahead of the next line
+	if (t1 < SLEEP_TIME) profacc += SLEEP_TIME - t1;
+	if (LineCount == 1) {
+		proffree = profacc;
+		if (proffree < proffreemin) proffreemin = proffree;
+		profacc = 0;
+	}
+}
+#endif
+
+//==================================
+//Send Rx Ready if the FFT MCU has Tx Ready up and a whole 4 byte packet
+//fits in the receive ring. Timer2 drops it again at RX_CUTOFF, so a packet
+//always arrives before the sleep ahead of the next sync pulse.
+//Without Tx Ready it is still sent while a command waits to be clocked
+//out, running or not: that is what wakes a paused FFT MCU for the resume
+//command. Otherwise a paused FFT MCU stays powered down.
+//Only called on blank lines.
+static inline void rx_ready(void) {
+	unsigned int t;
+
+	if ((PIND & (1<<PIND6)) != (1<<PIND6)
+		&& txtail == txhead && (UCSR1A & (1<<TXC1))) return;
+	if (((rxtail - rxhead - 1) & RX_MASK) < 4) return;
+	t = TCNT1;
+	if (t >= RX_CUTOFF) return;
+	PORTD |= (1<<PORTD7);
+	TCNT2 = 0;
+	OCR2A = ((RX_CUTOFF - t) >> 3) + 1;	// +1, a match right after the TCNT2 write is lost
+	TIFR2 = (1<<OCF2A);
+	TIMSK2 = (1<<OCIE2A);
+}
+
+#if REPLAY
+//==================================
+//Put the next packet of the replay table into the receive ring,
+//in place of rx_ready() and the receive ISR
+static inline void rx_replay(void) {
+	if (LineCount == 1) {
+		replayfields++;
+		if (replaytick < 255) replaytick++;
+	}
+	if (replaybyte == 0 && replaytick < REPLAY_PACE) return;
+	if (((rxtail - rxhead - 1) & RX_MASK) < 4) return;
+	for (char i = 0; i < 4; i++) {
+		rxring[rxhead] = pgm_read_byte(&replayFrames[replayframe][replaybyte++]);
+		rxhead = (rxhead + 1) & RX_MASK;
+	}
+	if (replaybyte == LINK_FRAME) {
+		replaybyte = 0;
+		replaytick = 0;
+		if (++replayframe == REPLAY_FRAMES) replayframe = 0;
+	}
+}
+#endif
+
 //==================================
 //This is the sync generator and raster generator. It MUST be entered from 
 //sleep mode to get accurate timing of the sync pulses
 
 ISR (TIMER1_COMPA_vect) {
 	int screenStart ;
+	char* line ;
 
 	//start the Horizontal sync pulse 
 	PORTD = syncON;
+#if PROFILE_RASTER
+	unsigned int t0 = TCNT1;
+#endif
 
 	//update the current scanline number
 	LineCount++;   
@@ -1416,50 +1795,121 @@ ISR (TIMER1_COMPA_vect) {
 	if (LineCount < ScreenBot && LineCount >= ScreenTop) {
 		//compute offset into screen array
 		screenStart = (LineCount - ScreenTop) * bytes_per_line;
+#if FRAME_MODE == FRAME_WATERFALL
+		//waterfall lines show the ring rows from wftop down, so scrolling is
+		//just moving wftop. The line below them repeats the bottom border.
+		if (LineCount >= ScreenTop + TextBot) {
+			int row = LineCount - ScreenTop - TextBot;
+			if (row < WF_ROWS) {
+				row += wftop;
+				if (row > WF_ROWS) row -= WF_ROWS+1;
+				screenStart = (TextBot + row) * bytes_per_line;
+			}
+			else screenStart = height * bytes_per_line;
+		}
+#endif
+#if FRAME_MODE == FRAME_RACE
+		//bar lines come from the line buffer built during the line before
+		if (LineCount >= ScreenTop + TextBot) line = linebuf;
+		else line = screenindex + screenStart;
+#else
+		line = screenindex + screenStart;
+#endif
 		//center image on screen
-		_delay_us(7);
-		//blast the 20 bytes of data for this line to the screen
-		UDR0 = screen[screenStart] ;
+		_delay_us(line_delay);
+		//blast the bytes of data for this line to the screen, the first
+		//two fill the USART, the rest go in as each one empties
+		UDR0 = line[0] ;
     	UCSR0B = _BV(TXEN0);
-		UDR0 = screen[screenStart+1] ;
-		for (int x = 2; x < bytes_per_line; x++)
-		begin
-			while (!(UCSR0A & _BV(UDRE0))) ;
-			UDR0 = screen[screenStart+x] ;
-		end
+		UDR0 = line[1] ;
+		line += 2;
+		LINE_REST
 		UCSR0B = 0 ;
+#if FRAME_MODE == FRAME_RACE
+		//the bytes are in the USART, start on the next line
+		race_line(LineCount - ScreenTop + 1);
+#endif
 	//else if non-display lines...Receive data from other MCU
 	}  else {
-		// Wait For Tx Ready signal and freq bin buffer not full
-		if (((PIND & (1<<PIND6)) == (1<<PIND6)) && (currbin<bins)) {
-			// Send Rx Ready signal
-			PORTD |= (1<<PORTD7);		
-			// Receive 4 bytes at a time
-			while ( !(UCSR1A & (1<<RXC1)) );
-			// Send Rx Not Ready signal immediately after 1st byte received
-			// to account for delay between transmit start and end
-			// since FFT MCU blasts 4 bytes at a time anytime Rx is ready
-		    PORTD &= ~(1<<PORTD7);
-			hist[currbin++] = UDR1;
-			while ( !(UCSR1A & (1<<RXC1)) );
-			hist[currbin++] = UDR1;
-			while ( !(UCSR1A & (1<<RXC1)) );
-			hist[currbin++] = UDR1;
-			while ( !(UCSR1A & (1<<RXC1)) );
-			hist[currbin++] = UDR1;
+#if FRAME_MODE == FRAME_DOUBLE
+		// flip in the finished back buffer while nothing is being scanned out
+		if (swapreq) {
+			screenindex = screen;
+			swapreq = 0;
+		}
+#elif FRAME_MODE == FRAME_RACE
+		// flip in the finished back bar lists
+		if (swapreq) {
+			racefront = raceback;
+			swapreq = 0;
 		}
+#elif FRAME_MODE == FRAME_WATERFALL
+		// scroll the finished row in
+		if (swapreq) {
+			wftop = wfnext;
+			swapreq = 0;
+		}
+#endif
+		if (LineCount == 1) {
+			buttons_scan(BUTTON_MASK);
+			if (fieldtick < 255) fieldtick++;
+		}
+#if REPLAY
+		rx_replay();
+#else
+		// Ask for the next packet, the receive ISR takes it from here
+		// (the sync pulse above has already dropped Rx Ready)
+		rx_ready();
+#endif
 	}
+#if PROFILE_RASTER
+	prof_line(t0);
+#endif
+}
+
+//==================================
+//Receive a byte from the FFT MCU, only enabled by Rx Ready on blank lines
+ISR (USART1_RX_vect) {
+#if PROFILE_RASTER
+	unsigned int t0 = TCNT1;
+#endif
+	// Send Rx Not Ready as soon as a packet starts arriving
+	// since FFT MCU blasts 4 bytes at a time anytime Rx is ready
+	PORTD &= ~(1<<PORTD7);
+	rxring[rxhead] = UDR1;
+	rxhead = (rxhead + 1) & RX_MASK;
+	// at the end of a packet ask for another while still in blanking
+	if ((++rxpkt & 3) == 0 && (LineCount >= ScreenBot || LineCount < ScreenTop))
+		rx_ready();
+#if PROFILE_RASTER
+	// this time is taken from main
+	profacc -= TCNT1 - t0;
+#endif
 }
 
 //==================================
-//plot a white vertical line at position x with height y
-//by plotting white dots one by one vertically
-void video_vert_line(char x, char y){
-	int i = (x >> 3) + (int)(y * bytes_per_line) ;
-	while(i < 3980) begin // i<199*20
-		screen[i] = screen[i] | pos[x & 7];
-		i = i + 20;
-	end
+//fill lines y1 to y2-1 of bar j with color 1=white 0=black 2=invert
+//a whole bar row is one or two byte writes using its precomputed masks
+void video_bar(char j, char y1, char y2, char c) {
+	int i = barbyte[j] + (int)y1 * bytes_per_line;
+	char m0 = barmask[j][0];
+	char m1 = barmask[j][1];
+
+	for ( ; y1 < y2; y1++) {
+		if (c==1) {
+			screen[i] = screen[i] | m0;
+			screen[i+1] = screen[i+1] | m1;
+		}
+		else if (c==2) {
+			screen[i] = screen[i] ^ m0;
+			screen[i+1] = screen[i+1] ^ m1;
+		}
+		else {
+			screen[i] = screen[i] & ~m0;
+			screen[i+1] = screen[i+1] & ~m1;
+		}
+		i = i + bytes_per_line;
+	}
 }
 
 //==================================
@@ -1479,6 +1929,37 @@ void video_pt(char x, char y, char c) {
 	  screen[i] = screen[i] ^ pos[x & 7];
 }
 
+//==================================
+//fill lines y1 to y2-1 of bar j with brightness level 0-16
+//by copying the ordered dither masks in under the bar masks
+void video_shade(char j, char y1, char y2, char level) {
+	int i = barbyte[j] + (int)y1 * bytes_per_line;
+	char m0 = barmask[j][0];
+	char m1 = barmask[j][1];
+	char pat;
+
+	for ( ; y1 < y2; y1++) {
+		pat = dithermask[(int)level][y1 & 3];
+		screen[i] = (screen[i] & ~m0) | (pat & m0);
+		screen[i+1] = (screen[i+1] & ~m1) | (pat & m1);
+		i = i + bytes_per_line;
+	}
+}
+
+#if FRAME_MODE == FRAME_WATERFALL
+//==================================
+//draw the current bins as one waterfall row at line y
+//each bin is shown as 17 levels of brightness using ordered dithering
+void video_wfrow(char y) {
+	int i = (int)y * bytes_per_line;
+
+	memset(&screen[i], 0, bytes_per_line);
+	screen[i+bytes_per_line-1] = 0x01;	//right border
+	for (char j = firstbin; j < bins; j++)
+		video_shade(j, y, y+1, (oldhist[j]+8) >> 4);
+}
+#endif
+
 //==================================
 //plot a line 
 //at x1,y1 to x2,y2 with color 1=white 0=black 2=invert 
@@ -1636,101 +2117,74 @@ char video_set(char x, char y) {
     return (screen[i] & 1<<(7-(x & 0x7)));   	
 } 
 
+//==================================
+//return the log scale bar height of a 16 bit magnitude times 2^octaves
+unsigned char video_log16(unsigned int x, int octaves) {
+	int h = octaves * LOG16_OCTAVE;
+
+	if (x == 0) return 0;
+	//normalize to 128-255, one octave per shift
+	while (x >= 256) {x >>= 1; h += LOG16_OCTAVE;}
+	while (x < 128) {x <<= 1; h -= LOG16_OCTAVE;}
+	h = (h + (int)pgm_read_word(&logMant[x-128])) >> 4;
+	if (h < 0) return 0;
+	if (h > LOG_HEIGHT) return LOG_HEIGHT;
+	return h;
+}
+
+//==================================
+//return the bar height of a bin sent with LINK_AGC: the FFT MCU shifted its
+//input by linkhdr[1] instead of LINK_GAIN_REF, each shift is 4x in magnitude
+unsigned char video_agc(unsigned char m) {
+	int g = 2 * ((int)linkhdr[1] - LINK_GAIN_REF);	// octaves of gain
+	unsigned int v;
+
+	if (logopt == 1) return video_log16(m, -g);
+	if (g >= 8) return 0;
+	if (g >= 0) return m >> g;
+	v = (unsigned int)m << -g;
+	return (v > 255) ? 255 : v;
+}
+
 //===================================
-//Button Press Debounce FSMs
-
-void runStopFSM(void){
-	switch(runState){
-		//starting state
-		case Release:
-			if ( (buttons & (1<<2)) == (1<<2)) runState=Debounce;
-			else runState=Release;
-		break;
-		// see if button is still pressed
-		case Debounce:
-		    if((buttons & (1<<2)) == (1<<2)) runState=Pressed;
-        	else runState=Release;
-		break;
-		// wait for release
-		case Pressed:
-		    if ((buttons & (1<<2)) == (1<<2)) runState=Pressed; 
-        else runState=DebounceRel;
-		break;
-		// see if button is still released 
-		case DebounceRel:
-		    if ((buttons & (1<<2)) == (1<<2)) runState=Pressed; 
-			else runState=Toggle;
-		break;
-		// toggle user option value and label
-		case Toggle:
-			runState=Release;
-			if (runopt == 1) {runopt = 0; sprintf(runval,"Y");}
-			else {runopt = 1; sprintf(runval,"N");}
-		break;
-	}
+//Queue a command for the FFT MCU, dropped if the ring is full
+void cmd_send(unsigned char c) {
+	if (((txhead + 1) & TX_MASK) == txtail) return;
+	txring[txhead] = c;
+	txhead = (txhead + 1) & TX_MASK;
 }
 
-void logScaleFSM(void){
-	switch(logState){
-		//starting state
-		case Release:
-			if ( (buttons & (1<<1)) == (1<<1)) logState=Debounce;
-			else logState=Release;
-		break;
-		// see if button is still pressed
-		case Debounce:
-		    if((buttons & (1<<1)) == (1<<1)) logState=Pressed;
-        	else logState=Release;
-		break;
-		// wait for release
-		case Pressed:
-		    if ((buttons & (1<<1)) == (1<<1)) logState=Pressed; 
-        else logState=DebounceRel;
-		break;
-		// see if button is still released 
-		case DebounceRel:
-		    if ((buttons & (1<<1)) == (1<<1)) logState=Pressed; 
-			else logState=Toggle;
-		break;
-		// toggle user option value and label
-		case Toggle:
-			logState=Release;
-			if (logopt == 1) {logopt = 0; sprintf(logval,"N");}
-			else {logopt = 1; sprintf(logval,"Y");}
-		break;
+//===================================
+//Button option handlers, toggle or cycle the option and its label
+
+void runToggle(void){
+	if (bursthold) {
+		// let go of the burst and wait for the next trigger
+		bursthold = 0;
+		runval = "N";
+		cmd_send(CMD_TRIGGER | TRIG_MODE);
+		return;
 	}
+	if (runopt == 1) {runopt = 0; runval = "Y";}
+	else {
+		runopt = 1; runval = "N";
+		// resume with the FFT MCU's next, fresh frame
+		cli();
+		rxtail = rxhead;
+		sei();
+		currbin = 0;
+	}
+	cmd_send(CMD_PAUSE | (runopt ^ 1));
 }
 
-void decayFSM(void){
-	switch(decayState){
-		//starting state
-		case Release:
-			if ( (buttons & (1<<0)) == (1<<0)) decayState=Debounce;
-			else decayState=Release;
-		break;
-		// see if button is still pressed
-		case Debounce:
-		    if((buttons & (1<<0)) == (1<<0)) decayState=Pressed;
-        	else decayState=Release;
-		break;
-		// wait for release
-		case Pressed:
-		    if ((buttons & (1<<0)) == (1<<0)) decayState=Pressed; 
-        else decayState=DebounceRel;
-		break;
-		// see if button is still released 
-		case DebounceRel:
-		    if ((buttons & (1<<0)) == (1<<0)) decayState=Pressed; 
-			else decayState=Toggle;
-		break;
-		// cycle user option value and label
-		case Toggle:
-			decayState=Release;
-			if (decayopt == 1) {decayopt = 3; sprintf(decayval,"S");}
-			else if (decayopt == 2) {decayopt = 1; sprintf(decayval,"F");}
-			else if (decayopt == 3) {decayopt = 2; sprintf(decayval,"M");}
-		break;
-	}
+void logToggle(void){
+	if (logopt == 1) {logopt = 0; logval = "N";}
+	else {logopt = 1; logval = "Y";}
+}
+
+void decayToggle(void){
+	decayopt = (decayopt == 1) ? 3 : decayopt-1;	// slow, medium, fast
+	decayval = decaylabel[decayopt];
 }
 
 
@@ -1754,13 +2208,20 @@ int main() {
   // USART in MSPIM mode, transmitter enabled, frequency 4 MHz for Video Output
   UCSR0B = _BV(TXEN0);						// Transmit enable
   UCSR0C = _BV(UMSEL01) | _BV(UMSEL00);		// MSPIM mode
-  UBRR0 = 1 ;								// 4 MHz
+  UBRR0 = video_ubrr ;						// 4 MHz, or 8 MHz for VIDEO_256
 
   // USART in Synchronous Mode for Rx from FFT MCU at 2Mbps
    UCSR1C = (1<<UMSEL10) | (1<<UCSZ11) | (1<<UCSZ10);	// USART in Synchronous mode, 8-bit character size
-   UCSR1B = (1<<RXEN1);									// Receive enable
+#if REPLAY
+   UCSR1B = 0;											// Rx Ready is never raised, the FFT MCU waits
+#else
+   UCSR1B = (1<<RXEN1) | (1<<RXCIE1) | (1<<TXEN1);		// Receive enable, receive interrupt, commands out
+#endif
    UBRR1L = 3;											// 2Mbps rate
 
+  // TIMER 2: fosc/8, times Rx Ready out at RX_CUTOFF
+  TCCR2B = _BV(CS21);
+
   //initialize synch constants 
   LineCount = 1;
   syncON = 0b00000000;
@@ -1768,14 +2229,50 @@ int main() {
   
   //initialize variables
   currbin=0;
+  rxhead=0;
+  rxtail=0;
+  rxpkt=0;
+#if REPLAY
+  replayframe=0;
+  replaybyte=0;
+  replaytick=0;
+  replayfields=0;
+  replaydrawn=0;
+#endif
   for(int i=0;i<bins;i++) {
   	oldhist[i]=0;
+  	// bar masks, bar i is bar_width pixels wide starting at x = i*bar_pitch
+  	xpos = i*bar_pitch;
+  	unsigned int m = (0xffff << (16 - bar_width)) >> (xpos & 7);
+  	barbyte[i] = xpos >> 3;
+  	barmask[i][0] = m >> 8;
+  	barmask[i][1] = m & 0xff;
+#if FRAME_MODE == FRAME_BARLIST
+  	barlist[i]=0;
+#endif
+#if PEAK_HOLD
+  	peak[i]=0;
+  	peakhold[i]=0;
+  	capline[i]=0;
+#endif
   }
-  //create natural log table
-  logTable[0]=0;
-  logTable[1]=0;
-  for(int i=2;i<256;i++) {
-  	logTable[i] = (char)(log((double)i)*45-30); //scale log scale to fit well in screen
+#if FRAME_MODE == FRAME_RACE
+  //empty bar lists
+  memset(racehead, RACE_END, sizeof(racehead));
+  raceback=0;
+  racefront=1;
+#endif
+#if FRAME_MODE == FRAME_WATERFALL
+  wftop=0;
+#endif
+  //build the dither byte masks, pixel x of a byte is lit at a level
+  //above the threshold for its column
+  for(int l=0;l<17;l++) {
+  	for(int r=0;r<4;r++) {
+  		dithermask[l][r]=0;
+  		for(int x=0;x<8;x++)
+  			if (l > dither[r][x & 3]) dithermask[l][r] |= pos[x];
+  	}
   }
   
   //Print static messages
@@ -1785,28 +2282,50 @@ int main() {
   video_puts(105,32,runmsg);
   video_puts(105,42,logmsg);
   video_puts(105,52,decaymsg);
+#if PROFILE_RASTER
+  video_puts(5,12,"Free cyc");
+  proffreemin = 0x7fffffff;
+#endif
+#if REPLAY
+  video_puts(5,42,"Replay/s");
+#endif
 
   //Borders
+#if FRAME_MODE == FRAME_RACE
+  //the raster ISR draws the borders around the bars
+  video_line(width,0,width,TextBot-1,1);
+  video_line(0,10,width,10,1);
+  video_line(0,0,width,0,1);
+#else
   video_line(width,0,width,height,1);
   video_line(0,10,width,10,1);
   video_line(0,0,width,0,1);
   video_line(0,height,width,height,1);
+#endif
 
+#if FRAME_MODE == FRAME_SINGLE || FRAME_MODE == FRAME_DOUBLE
   // Copy static elements into screen clearing buffer
   memcpy(erasescreen, screen, screen_array_size);
+#endif
 
   // User options and buttons
   runopt=1;		// Initially not paused
   logopt=0;		// Initially linear amplitude scale
   decayopt=2;	// Initially medium decay speed
-  runState = Release;
-  logState = Release;
-  decayState = Release;
-  sprintf(runval,"N");
-  sprintf(logval,"N");
-  sprintf(decayval,"M");
-  sprintf(freqval,"2");
-  sprintf(binval,"62.5");
+  runval = "N";
+  logval = "N";
+  decayval = decaylabel[decayopt];
+  freqval = "2";
+  binval = "62.5";
+
+  // Set up the FFT MCU
+  burstn = 0;
+  bursthold = 0;
+  fieldtick = 0;
+  txhead = 0;
+  txtail = 0;
+  for (char i=0; i<sizeof(bootConfig); i++)
+	cmd_send(bootConfig[i]);
 
   // Set up single video line timing
   sei();
@@ -1814,39 +2333,169 @@ int main() {
   sleep_enable();
 
   while(1) {
-  	// store Port C and update button press FSMs
-  	buttons=PINC;
-	runStopFSM();
-	logScaleFSM();
-	decayFSM();
-	//check to see if FFT MCU has changed the freq scale
-	if ((PINB & (1<<PINB3)) == (1<<PINB3)) {sprintf(freqval,"2"); sprintf(binval,"62.5");}
-	else {sprintf(freqval,"4"); sprintf(binval,"125 ");}
+	// run the option handlers of buttons the sync ISR saw released
+	if (btnevents) buttons_run(videoButtons, BUTTONS);
+	// queue the next command for the FFT MCU's link clock
+	if (txtail != txhead && (UCSR1A & (1<<UDRE1))) {
+		UCSR1A = (UCSR1A & (1<<U2X1)) | (1<<TXC1);	// set again once it is out, the error flags written 0
+		UDR1 = txring[txtail];
+		txtail = (txtail + 1) & TX_MASK;
+	}
+	// Move received bytes into the freq bin buffer
+	while (currbin<LINK_FRAME && rxtail != rxhead) {
+		// a frame starts with the sync byte, anything else is skipped to realign
+		if (currbin >= LINK_HEADER) hist[currbin++ - LINK_HEADER] = rxring[rxtail];
+		else if (currbin > 0 || rxring[rxtail] == LINK_SYNC) linkhdr[currbin++] = rxring[rxtail];
+		rxtail = (rxtail + 1) & RX_MASK;
+		// a paused FFT MCU only sends the header
+		if (currbin == LINK_HEADER && (linkhdr[2] & LINK_IDLE)) currbin = 0;
+	}
+	// Keep the frames of a trigger burst, the last one starts the hold
+	if (currbin>=LINK_FRAME && (linkhdr[2] & LINK_TRIG)) {
+		if (linkhdr[3] < BURST_MAX && !bursthold) {
+			if (linkhdr[3] == 0) burstn = 0;
+			memcpy(burst[linkhdr[3]], linkhdr, LINK_HEADER);
+			memcpy(burst[linkhdr[3]]+LINK_HEADER, (void*)hist, bins);
+			burstn = linkhdr[3]+1;
+			if ((linkhdr[2] & LINK_LAST) && runopt == 1) {
+				bursthold = 1;
+				burstshow = 0;
+				fieldtick = HOLD_STEP;
+				runval = "T";
+			}
+		}
+		currbin = 0;
+	}
+	// While paused or holding a burst the frames still in flight are dropped
+	if (currbin>=LINK_FRAME && (runopt == 0 || bursthold)) currbin = 0;
+	// Step through the held burst, drawn like a received frame
+	if (bursthold && currbin == 0 && fieldtick >= HOLD_STEP) {
+		fieldtick = 0;
+		memcpy(linkhdr, burst[burstshow], LINK_HEADER);
+		memcpy((void*)hist, burst[burstshow]+LINK_HEADER, bins);
+		if (++burstshow >= burstn) burstshow = 0;
+		currbin = LINK_FRAME;
+	}
 	// If not paused and full freq bin buffer received...
-  	if (currbin>=bins && runopt == 1) {
+  	if (currbin>=LINK_FRAME && runopt == 1) {
+#if FRAME_MODE == FRAME_SINGLE || FRAME_MODE == FRAME_DOUBLE
 		// Clear screen with static messages
   		memcpy(screen, erasescreen, screen_array_size);
-		// Print out all bins except first since mostly DC content
-    	for(int j=1; j<bins; j++) begin
-			// calculate x position
-			xpos = j*5-2;
-			//log amplitude if selected
-			if(logopt == 1) hist[j]=logTable[hist[j]];
+#elif FRAME_MODE == FRAME_BARLIST
+		// Only redraw while the raster ISR is in vertical blanking, and
+		// only start with enough of it left to finish before the screen
+		while (blank_left() < BARLIST_LINES) ;
+#elif FRAME_MODE == FRAME_RACE
+		// Start with empty back bar lists
+		memset(racehead[raceback], RACE_END, bar_max+1);
+#endif
+		// Print out all bins, except the first while it is mostly DC content
+		firstbin = (linkhdr[2] & LINK_DC) ? 0 : 1;
+    	for(int j=firstbin; j<bins; j++) begin
+			//take the FFT MCU's gain back out, or log amplitude if selected
+			if (linkhdr[2] & LINK_AGC) hist[j]=video_agc(hist[j]);
+			else if(logopt == 1) hist[j]=pgm_read_byte(&logTable[hist[j]]);
 			//RC decay display
-			if(hist[j]>=oldhist[j]) {ypos = 199-hist[j]; oldhist[j]=hist[j];}
-			else {oldhist[j]=(oldhist[j]-(oldhist[j]>>decayopt)); ypos = 199-oldhist[j];}
+			if(hist[j]>=oldhist[j]) oldhist[j]=hist[j];
+			else oldhist[j]=(oldhist[j]-(oldhist[j]>>decayopt));
+			ypos = (oldhist[j] > bar_max) ? bar_max : oldhist[j];
+#if PEAK_HOLD
+			unsigned char cap;	// line of the peak cap
+			//Peak jumps up with the bar, is held, then falls back to it
+			if (ypos >= peak[j]) {peak[j] = ypos; peakhold[j] = PEAK_HOLD;}
+			else if (peakhold[j] > 0) peakhold[j]--;
+			else if (peak[j] > ypos + PEAK_FALL) peak[j] -= PEAK_FALL;
+			else peak[j] = ypos;
+#endif
+#if FRAME_MODE == FRAME_BARLIST
+#if PEAK_HOLD
+			//Invert the old cap line away before the bar can grow over it
+			if (peak[j] == 0) cap = 0;
+			else cap = (peak[j] < bar_max) ? bar_bottom-1-peak[j] : bar_bottom-bar_max;
+			if (cap != capline[j] && capline[j] > 0) video_bar(j, capline[j], capline[j]+1, 2);
+#endif
+			//Grow or shrink the 4 pixel wide bar by the lines that changed
+			if (ypos > barlist[j]) video_bar(j, bar_bottom-ypos, bar_bottom-barlist[j], 1);
+			else video_bar(j, bar_bottom-barlist[j], bar_bottom-ypos, 0);
+			barlist[j] = ypos;
+#if PEAK_HOLD
+			//and invert the new one in, a frame costs two lines per moved cap
+			if (cap != capline[j]) {
+				if (cap > 0) video_bar(j, cap, cap+1, 2);
+				capline[j] = cap;
+			}
+#endif
+#elif FRAME_MODE == FRAME_RACE
+			//Add the bar to the list of the line its top is on
+			if (ypos > 0) {
+				racenext[raceback][j] = racehead[raceback][bar_max-ypos];
+				racehead[raceback][bar_max-ypos] = j;
+			}
+#elif FRAME_MODE == FRAME_WATERFALL
+			//the whole row is drawn below
+#else
 			//Display 4 pixel wide bars
-			video_vert_line(xpos, ypos);
-			video_vert_line(xpos+1, ypos);
-			video_vert_line(xpos+2, ypos);
-			video_vert_line(xpos+3, ypos);
+			video_bar(j, bar_bottom-ypos, bar_bottom, 1);
+#if PEAK_HOLD
+			//and the cap on the freshly erased frame, kept below the title line
+			if (peak[j] > 0) {
+				cap = (peak[j] < bar_max) ? bar_bottom-1-peak[j] : bar_bottom-bar_max;
+				video_bar(j, cap, cap+1, 1);
+			}
+#endif
+#endif
 		end
+#if FRAME_MODE == FRAME_WATERFALL
+		// Draw the frame into the spare ring row above the newest one
+		wfnext = (wftop == 0) ? WF_ROWS : wftop-1;
+		video_wfrow(TextBot + wfnext);
+#endif
+		// Check to see if FFT MCU has changed the freq scale
+#if REPLAY
+		if (REPLAY_FREQOPT == 1) {freqval = "2"; binval = "62.5";}
+#else
+		if ((PINB & (1<<PINB3)) == (1<<PINB3)) {freqval = "2"; binval = "62.5";}
+#endif
+		else {freqval = "4"; binval = "125 ";}
 		// Reprint current values of user options
 		video_puts(130,12,freqval);
 		video_puts(122,22,binval);
 		video_puts(150,32,runval);
 		video_puts(150,42,logval);
 		video_puts(150,52,decayval);
+#if PROFILE_RASTER
+		// Main loop cycles in the last frame and the fewest so far
+		sprintf(profval,"%6ld",proffree);
+		video_puts(5,22,profval);
+		sprintf(profval,"%6ld",proffreemin);
+		video_puts(5,32,profval);
+#endif
+#if REPLAY
+		// Replayed frames drawn in the last 60 video frames
+		replaydrawn++;
+		if (replayfields >= 60) {
+			sprintf(replayval,"%4d",replaydrawn);
+			video_puts(5,52,replayval);
+			replayfields = 0;
+			replaydrawn = 0;
+		}
+#endif
+#if FRAME_MODE == FRAME_DOUBLE
+		// Hand the finished frame to the raster ISR and draw the next one
+		// into the buffer it was displaying
+		swapreq = 1;
+		while (swapreq) ;
+		screen = (screen == screenbuf[0]) ? screenbuf[1] : screenbuf[0];
+#elif FRAME_MODE == FRAME_RACE
+		// Same for the bar lists
+		swapreq = 1;
+		while (swapreq) ;
+		raceback = racefront ^ 1;
+#elif FRAME_MODE == FRAME_WATERFALL
+		// Scroll the new row in at the top
+		swapreq = 1;
+		while (swapreq) ;
+#endif
 		// Initiate receive next freq bin buffer from other MCU
 		currbin=0;
 	}  //if